@@ -0,0 +1,240 @@
+#pragma once
+
+#include <cstdint>
+#include <initializer_list>
+
+#include "instructions.hpp"
+
+/*
+
+BYTECODE SCHEMA
+    Operand layout of every opcode, so tools and the module loader can walk bytecode without running it.
+    Entries must carry the same order as the opcode enum, this is checked at compile time.
+
+    Relative code operands:
+        JUMP8, JUMP16 and CALL32 are relative to the start of the instruction.
+        BRANCH16 is relative to the end of the instruction.
+*/
+
+enum operand_kind : uint8_t {
+    OPERAND_REG,        // 8 bits, register that is read.
+    OPERAND_DEST,       // 8 bits, register that is written.
+    OPERAND_RESULT,     // 8 bits, register + 1 written when the callee returns, 0 for none.
+    OPERAND_TYPE,       // 8 bits, value_type.
+    OPERAND_BYTE,       // 8 bits, plain value.
+    OPERAND_IMM16,
+    OPERAND_IMM32,
+    OPERAND_IMM64,
+    OPERAND_LITERAL,    // 16 bits, literal id.
+    OPERAND_LOCAL,      // 16 bits, local index.
+    OPERAND_FUNCTION,   // 16 bits, function id. See module.hpp.
+    OPERAND_JUMP8,      // i8
+    OPERAND_JUMP16,     // i16
+    OPERAND_BRANCH16,   // i16
+    OPERAND_CALL32,     // i32
+    OPERAND_ARGS,       // 8 bits count, followed by that many registers that are read.
+};
+
+constexpr auto OPERAND_MAX = 8;
+
+struct opcode_info {
+    opcode op;
+    const char* name;
+    uint8_t operand_count;
+    operand_kind operands[OPERAND_MAX];
+};
+
+#define _OPS(...) static_cast<uint8_t>(std::initializer_list<operand_kind>{__VA_ARGS__}.size()), { __VA_ARGS__ }
+
+inline constexpr opcode_info opcode_schema[] = {
+    { OP_OUT,                   "OP_OUT",                   _OPS(OPERAND_TYPE, OPERAND_REG) },
+    { OP_LOAD,                  "OP_LOAD",                  _OPS(OPERAND_DEST, OPERAND_LITERAL) },
+    { OP_B_ADD,                 "OP_B_ADD",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_SUB,                 "OP_B_SUB",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_MUL,                 "OP_B_MUL",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_DIV,                 "OP_B_DIV",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_MORE,                "OP_B_MORE",                _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_LESS,                "OP_B_LESS",                _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_B_EQUAL,               "OP_B_EQUAL",               _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_MALLOC,                "OP_MALLOC",                _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_MFREE,                 "OP_MFREE",                 _OPS(OPERAND_REG, OPERAND_REG) },
+    { OP_MWRITE,                "OP_MWRITE",                _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MREAD,                 "OP_MREAD",                 _OPS(OPERAND_REG, OPERAND_DEST, OPERAND_REG) },
+    { OP_PUSH_LOCAL,            "OP_PUSH_LOCAL",            _OPS(OPERAND_REG) },
+    { OP_COPY_LOCAL,            "OP_COPY_LOCAL",            _OPS(OPERAND_DEST, OPERAND_LOCAL) },
+    { OP_CALL,                  "OP_CALL",                  _OPS(OPERAND_CALL32, OPERAND_RESULT, OPERAND_ARGS) },
+    { OP_DESYNC,                "OP_DESYNC",                _OPS(OPERAND_CALL32, OPERAND_ARGS) },
+    { OP_RETURN,                "OP_RETURN",                _OPS(OPERAND_REG) },
+    { OP_JUMP_I8,               "OP_JUMP_I8",               _OPS(OPERAND_JUMP8) },
+    { OP_JUMP_I16,              "OP_JUMP_I16",              _OPS(OPERAND_JUMP16) },
+    { OP_JUMP_IF_FALSE,         "OP_JUMP_IF_FALSE",         _OPS(OPERAND_REG, OPERAND_BRANCH16) },
+    { OP_U_NOT,                 "OP_U_NOT",                 _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_U_NEG,                 "OP_U_NEG",                 _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_V_ADD,                 "OP_V_ADD",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_SUB,                 "OP_V_SUB",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_MUL,                 "OP_V_MUL",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_DIV,                 "OP_V_DIV",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_MIN,                 "OP_V_MIN",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_MAX,                 "OP_V_MAX",                 _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_MORE,                "OP_V_MORE",                _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_LESS,                "OP_V_LESS",                _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_EQUAL,               "OP_V_EQUAL",               _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_V_SUM,                 "OP_V_SUM",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_V_RMIN,                "OP_V_RMIN",                _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_V_RMAX,                "OP_V_RMAX",                _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_V_DOT,                 "OP_V_DOT",                 _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MCOPY,                 "OP_MCOPY",                 _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MMOVE,                 "OP_MMOVE",                 _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MSET,                  "OP_MSET",                  _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MCMP,                  "OP_MCMP",                  _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MCOPY_FROM_STATIC,     "OP_MCOPY_FROM_STATIC",     _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_MCOPY_TO_STATIC,       "OP_MCOPY_TO_STATIC",       _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_LOAD_IMM8,             "OP_LOAD_IMM8",             _OPS(OPERAND_DEST, OPERAND_BYTE) },
+    { OP_LOAD_IMM16,            "OP_LOAD_IMM16",            _OPS(OPERAND_DEST, OPERAND_IMM16) },
+    { OP_LOAD_IMM32,            "OP_LOAD_IMM32",            _OPS(OPERAND_DEST, OPERAND_IMM32) },
+    { OP_LOAD_IMM64,            "OP_LOAD_IMM64",            _OPS(OPERAND_DEST, OPERAND_IMM64) },
+    { OP_B_ADD_IMM,             "OP_B_ADD_IMM",             _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_SUB_IMM,             "OP_B_SUB_IMM",             _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_MUL_IMM,             "OP_B_MUL_IMM",             _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_DIV_IMM,             "OP_B_DIV_IMM",             _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_MORE_IMM,            "OP_B_MORE_IMM",            _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_LESS_IMM,            "OP_B_LESS_IMM",            _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_B_EQUAL_IMM,           "OP_B_EQUAL_IMM",           _OPS(OPERAND_TYPE, OPERAND_DEST, OPERAND_REG, OPERAND_IMM16) },
+    { OP_JUMP_IF_NOT_LESS_IMM,  "OP_JUMP_IF_NOT_LESS_IMM",  _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_IMM16, OPERAND_BRANCH16) },
+    { OP_JUMP_IF_NOT_MORE_IMM,  "OP_JUMP_IF_NOT_MORE_IMM",  _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_IMM16, OPERAND_BRANCH16) },
+    { OP_JUMP_IF_NOT_EQUAL_IMM, "OP_JUMP_IF_NOT_EQUAL_IMM", _OPS(OPERAND_TYPE, OPERAND_REG, OPERAND_IMM16, OPERAND_BRANCH16) },
+    { OP_TAIL_CALL,             "OP_TAIL_CALL",             _OPS(OPERAND_CALL32, OPERAND_ARGS) },
+    { OP_REGION_NEW,            "OP_REGION_NEW",            _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_REGION_ALLOC,          "OP_REGION_ALLOC",          _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG) },
+    { OP_REGION_RESET,          "OP_REGION_RESET",          _OPS(OPERAND_REG) },
+    { OP_REGION_FREE,           "OP_REGION_FREE",           _OPS(OPERAND_REG) },
+    { OP_HEAP_STAT,             "OP_HEAP_STAT",             _OPS(OPERAND_DEST, OPERAND_BYTE) },
+    { OP_CALL_FN,               "OP_CALL_FN",               _OPS(OPERAND_FUNCTION, OPERAND_RESULT, OPERAND_ARGS) },
+    { OP_DESYNC_FN,             "OP_DESYNC_FN",             _OPS(OPERAND_FUNCTION, OPERAND_ARGS) },
+    { OP_TREAD,                 "OP_TREAD",                 _OPS(OPERAND_REG, OPERAND_DEST, OPERAND_REG) },
+    { OP_TWRITE,                "OP_TWRITE",                _OPS(OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_PARALLEL_FOR,          "OP_PARALLEL_FOR",          _OPS(OPERAND_CALL32, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_RESULT, OPERAND_TYPE, OPERAND_BYTE, OPERAND_ARGS) },
+    { OP_FOPEN,                 "OP_FOPEN",                 _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG, OPERAND_BYTE) },
+    { OP_FCLOSE,                "OP_FCLOSE",                _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_FREAD,                 "OP_FREAD",                 _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_FWRITE,                "OP_FWRITE",                _OPS(OPERAND_DEST, OPERAND_REG, OPERAND_REG, OPERAND_REG, OPERAND_REG) },
+    { OP_IO_WAIT,               "OP_IO_WAIT",               _OPS(OPERAND_DEST, OPERAND_REG) },
+    { OP_JUMP_IF_TRUE,          "OP_JUMP_IF_TRUE",          _OPS(OPERAND_REG, OPERAND_BRANCH16) },
+};
+
+#undef _OPS
+
+constexpr auto OPCODE_COUNT = sizeof(opcode_schema) / sizeof(opcode_info);
+
+constexpr bool _is_schema_ordered() {
+    for (size_t i = 0; i < OPCODE_COUNT; i++) {
+        if (opcode_schema[i].op != i)
+            return false;
+    }
+
+    return OPCODE_COUNT == sizeof(instruction_jump_table) / sizeof(instruction_jump_table[0]);
+}
+
+static_assert(_is_schema_ordered(), "opcode_schema must list every opcode in enum order.");
+
+// Fixed size of an operand, ARGS only counts its count byte.
+constexpr t_chunk_pos operand_size(const operand_kind kind) {
+    switch (kind) {
+        case OPERAND_IMM16:
+        case OPERAND_LITERAL:
+        case OPERAND_LOCAL:
+        case OPERAND_FUNCTION:
+        case OPERAND_JUMP16:
+        case OPERAND_BRANCH16:
+            return 2;
+        case OPERAND_IMM32:
+        case OPERAND_CALL32:
+            return 4;
+        case OPERAND_IMM64:
+            return 8;
+        default:
+            return 1;
+    }
+}
+
+struct decoded_instruction {
+    opcode op{};
+    t_chunk_pos position = 0;
+    t_chunk_pos length = 0;
+
+    const opcode_info* info = nullptr;
+
+    // Raw operand values. For ARGS this is the argument count, the registers follow at operand_positions[i] + 1.
+    uint64_t operands[OPERAND_MAX] = {};
+    t_chunk_pos operand_positions[OPERAND_MAX] = {};
+};
+
+// Decodes the instruction at 'position'. Returns false for unknown opcodes and instructions that run past the end of 'chunk'.
+inline bool decode_instruction(const t_chunk& chunk, const t_chunk_pos position, decoded_instruction& out) {
+    if (position >= chunk.size() || chunk[position] >= OPCODE_COUNT)
+        return false;
+
+    out.op = static_cast<opcode>(chunk[position]);
+    out.info = &opcode_schema[out.op];
+    out.position = position;
+
+    // Chunks built before OP_RETURN took a register end in a bare OP_RETURN. It decodes as returning register 0,
+    // which is what the interpreter reads past the end of a chunk.
+    if (out.op == OP_RETURN && position + 1 == chunk.size()) {
+        out.operands[0] = 0;
+        out.operand_positions[0] = position + 1;
+        out.length = 1;
+        return true;
+    }
+
+    t_chunk_pos pos = position + 1;
+
+    for (uint8_t i = 0; i < out.info->operand_count; i++) {
+        const operand_kind kind = out.info->operands[i];
+        const t_chunk_pos size = operand_size(kind);
+
+        if (static_cast<uint64_t>(pos) + size > chunk.size())
+            return false;
+
+        out.operand_positions[i] = pos;
+
+        switch (size) {
+            case 1: out.operands[i] = chunk[pos++]; break;
+            case 2: out.operands[i] = _call_mergel_16(chunk, pos); break;
+            case 4: out.operands[i] = _call_mergel_32(chunk, pos); break;
+            case 8: out.operands[i] = _call_mergel_64(chunk, pos); break;
+        }
+
+        if (kind == OPERAND_ARGS) {
+            if (static_cast<uint64_t>(pos) + out.operands[i] > chunk.size())
+                return false;
+
+            pos += out.operands[i];
+        }
+    }
+
+    out.length = pos - position;
+    return true;
+}
+
+inline bool is_relative_code_operand(const operand_kind kind) {
+    return kind == OPERAND_JUMP8 || kind == OPERAND_JUMP16 || kind == OPERAND_BRANCH16 || kind == OPERAND_CALL32;
+}
+
+// Absolute position a relative code operand points at. May be out of range for malformed bytecode.
+inline int64_t relative_target(const decoded_instruction& instruction, const uint8_t operand) {
+    const uint64_t raw = instruction.operands[operand];
+
+    switch (instruction.info->operands[operand]) {
+        case OPERAND_JUMP8:    return static_cast<int64_t>(instruction.position) + static_cast<int8_t>(raw);
+        case OPERAND_JUMP16:   return static_cast<int64_t>(instruction.position) + static_cast<int16_t>(raw);
+        case OPERAND_BRANCH16: return static_cast<int64_t>(instruction.position) + instruction.length + static_cast<int16_t>(raw);
+        case OPERAND_CALL32:   return static_cast<int64_t>(instruction.position) + static_cast<int32_t>(raw);
+        default:               return -1;
+    }
+}
+
+// Whether control can never reach the instruction after this one.
+inline bool is_terminator(const opcode op) {
+    return op == OP_RETURN || op == OP_JUMP_I8 || op == OP_JUMP_I16 || op == OP_TAIL_CALL;
+}
@@ -0,0 +1,54 @@
+#pragma once
+
+#include <filesystem>
+
+#include "core.hpp"
+
+/*
+
+COMPRESSED CHUNK (.lch)
+    4 bytes - Magic "LCHZ"
+    8 bits  - Codec, 1 for LZ
+    32 bits - Chunk size (bytes, uncompressed)
+    32 bits - Block size (bytes, uncompressed). Every block but the last decodes to exactly this many bytes.
+    32 bits - Number of blocks
+
+        BLOCK
+            32 bits - Stored size (bytes). The high bit is set when the block is stored uncompressed.
+            x bytes - Block data
+
+The decoded bytes are a plain chunk, header included. Files without the magic are plain chunks and load as before.
+
+LZ blocks are a sequence of
+    8 bits  - Token. High nibble: literal count, low nibble: match length - 4. 15 means more length bytes follow.
+    x bytes - Literal count - 15, as a run of 255s ended by a smaller byte (only if the high nibble is 15)
+    x bytes - Literals
+    16 bits - Match offset, back from the current output position. Matches may reach into earlier blocks.
+    x bytes - Match length - 19, encoded like the literal count (only if the low nibble is 15)
+
+The last sequence of a block ends after its literals.
+*/
+
+constexpr char COMPRESSED_MAGIC[4] = { 'L', 'C', 'H', 'Z' };
+constexpr uint8_t CODEC_LZ = 1;
+
+constexpr uint32_t COMPRESSED_BLOCK_SIZE = 64 * 1024;
+
+// Larger blocks are rejected, it keeps a corrupt header from asking for huge read buffers.
+constexpr uint32_t COMPRESSED_BLOCK_MAX = 4 * 1024 * 1024;
+
+// Blocks the reader thread may run ahead of decoding.
+constexpr size_t COMPRESSED_READ_AHEAD = 4;
+
+// Whether the file at 'path' starts with the compressed chunk magic.
+bool is_compressed_chunk(const std::filesystem::path& path);
+
+// Compresses a whole chunk into the container above.
+t_chunk compress_chunk(const t_chunk& chunk, const uint32_t block_size = COMPRESSED_BLOCK_SIZE);
+
+// Decodes a container in memory. Throws vm_trap if it is malformed.
+t_chunk decompress_chunk(const t_chunk& data);
+
+// Streams a compressed file into a chunk. A reader thread fetches the next blocks while the current one
+// is decoded straight into the chunk buffer. Throws vm_trap if the file is malformed or can't be read.
+t_chunk read_compressed_chunk(const std::filesystem::path& path);
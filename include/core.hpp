@@ -11,15 +11,32 @@
 #include <bitset>
 #include <set>
 #include <memory>
+#include <atomic>
+#include <stdexcept>
+#include <chrono>
+#include <initializer_list>
+#include <utility>
 
 #include "util.hpp"
+#include "trace.hpp"
+#include "profile.hpp"
 
 void thread_safe_print(const std::string& string);
 
+class module_linker;
+class parallel_pool;
+class io_context;
+
 /*
 
 CHUNK
-    32 bits - Static memory size
+    32 bits - Static memory size. The high bit (CHUNK_TLS_FLAG) is not part of the size, it flags a TLS segment.
+
+    TLS (only if flagged)
+        32 bits - TLS segment size (bytes), every thread gets its own segment of this size
+        32 bits - Template size (bytes), at most the segment size
+        x bytes - Template, copied to the start of each new thread's segment. The rest starts zeroed.
+
     16 bits - Number of literals
 
         LITERAL
@@ -27,6 +44,7 @@ CHUNK
             x bytes - Literal binary
 
     x bytes - Opcodes
+        Immediate operands (IMM) are little endian and live inline with their opcode, they never go through the literal pool.
 
     1 byte - EOF - Mostly just so we can return something rather than undefined behavior if we move past EOF.
 */
@@ -44,6 +62,17 @@ constexpr auto LOCAL_STACK_MAX = UINT8_MAX;
 constexpr auto REGISTER_COUNT = UINT8_MAX;
 constexpr auto LOCAL_LIST_MAX = UINT8_MAX;
 
+// Fuel charged per call. Backward jumps are charged the number of bytes they jump back over, at least 1.
+constexpr int64_t FUEL_CALL_COST = 16;
+
+// Slice used when the budget has a fuel or time limit but no fuel_slice, since the limits are only checked between slices.
+constexpr uint64_t DEFAULT_FUEL_SLICE = 1 << 20;
+
+constexpr uint32_t CHUNK_TLS_FLAG = 0x80000000;
+
+// Bucket i counts allocations of [2^i, 2^(i+1)) bytes. Bucket 0 also takes 0 byte allocations.
+constexpr auto ALLOC_HISTOGRAM_BUCKETS = 32;
+
 // A chunk is a segment of bytecode. In this case it is what the ip will be swimming through.
 using t_chunk = std::vector<uint8_t>;
 using t_chunk_pos = uint32_t;
@@ -65,9 +94,99 @@ using t_heap_address = uint32_t;
 using t_static_memory = std::vector<uint8_t>;
 using t_static_address = uint32_t;
 
+using t_region_id = uint32_t;
+
+// Index into the program wide function table of module.hpp.
+using t_function_id = uint16_t;
+
+// Thrown when a thread can't continue, for example when the heap cap is hit.
+// execute_thread reports it and retires only the faulting thread.
+struct vm_trap : std::runtime_error {
+    using std::runtime_error::runtime_error;
+};
+
+// Allocation counters of a single thread slot. They accumulate across recycles of the slot.
+// Only the owning thread writes them, so they can be bumped with relaxed stores instead of locked increments,
+// while the host reads them at any time.
+struct thread_alloc_stats {
+    std::atomic<uint64_t> alloc_count{0};
+    std::atomic<uint64_t> free_count{0};
+    std::atomic<uint64_t> alloc_bytes{0};
+    std::atomic<uint64_t> free_bytes{0};
+    std::array<std::atomic<uint64_t>, ALLOC_HISTOGRAM_BUCKETS> size_histogram{};
+
+    inline void record_alloc(const t_heap_address size) {
+        _bump(alloc_count, 1);
+        _bump(alloc_bytes, size);
+        _bump(size_histogram[size_bucket(size)], 1);
+    }
+
+    inline void record_free(const t_heap_address size) {
+        _bump(free_count, 1);
+        _bump(free_bytes, size);
+    }
+
+    // Used by run_state::reset, only while the owning thread is stopped.
+    inline void clear() {
+        alloc_count.store(0, std::memory_order_relaxed);
+        free_count.store(0, std::memory_order_relaxed);
+        alloc_bytes.store(0, std::memory_order_relaxed);
+        free_bytes.store(0, std::memory_order_relaxed);
+
+        for (std::atomic<uint64_t>& bucket : size_histogram)
+            bucket.store(0, std::memory_order_relaxed);
+    }
+
+    // Folds in the counters of a thread that is done, like a parallel loop worker.
+    // Callers that merge from several threads serialize the calls themselves.
+    inline void add(const thread_alloc_stats& other) {
+        _bump(alloc_count, other.alloc_count.load(std::memory_order_relaxed));
+        _bump(free_count, other.free_count.load(std::memory_order_relaxed));
+        _bump(alloc_bytes, other.alloc_bytes.load(std::memory_order_relaxed));
+        _bump(free_bytes, other.free_bytes.load(std::memory_order_relaxed));
+
+        for (size_t bucket = 0; bucket < ALLOC_HISTOGRAM_BUCKETS; bucket++)
+            _bump(size_histogram[bucket], other.size_histogram[bucket].load(std::memory_order_relaxed));
+    }
+
+    static inline uint8_t size_bucket(const t_heap_address size) {
+        return size <= 1 ? 0 : 31 - __builtin_clz(size);
+    }
+private:
+    static inline void _bump(std::atomic<uint64_t>& counter, const uint64_t amount) {
+        counter.store(counter.load(std::memory_order_relaxed) + amount, std::memory_order_relaxed);
+    }
+};
+
+// Limits the host puts on each run of a thread (one execute_thread call). 0 means no limit.
+// Fuel approximates executed bytecode in bytes. It is only charged at backward jumps and calls,
+// so a thread can only be preempted at a point it can resume from.
+struct run_budget {
+    // Fuel granted per time slice. When a slice runs out the thread gives up its OS thread before continuing.
+    // 0 means no slicing, unless a run limit is set, then DEFAULT_FUEL_SLICE applies.
+    uint64_t fuel_slice = 0;
+
+    // Total fuel and wall time per run, checked at the end of every slice. Once exceeded the thread is suspended.
+    uint64_t run_fuel_limit = 0;
+    std::chrono::nanoseconds run_time_limit{0};
+
+    // File instructions trap unless set. Bytecode can then open any path the host process can.
+    bool allow_file_io = false;
+};
+
+// Snapshot of the shared heap. Regions count as live for their whole capacity.
+struct heap_stats {
+    t_heap_address heap_size = 0;
+    t_heap_address live_bytes = 0;
+    t_heap_address free_bytes = 0;
+    t_heap_address largest_free_block = 0;
+    t_heap_address free_block_count = 0;
+    t_heap_address heap_cap = 0;
+};
+
 struct call_frame {
-    call_frame(const t_chunk_pos return_address, const t_chunk_pos return_value_reg)
-        : return_address(return_address), return_value_reg(return_value_reg) {}
+    call_frame(const t_chunk_pos return_address, const t_chunk_pos return_value_reg, const t_chunk* return_chunk = nullptr, const t_literal_list* return_literal_list = nullptr)
+        : return_address(return_address), return_value_reg(return_value_reg), return_chunk(return_chunk), return_literal_list(return_literal_list) {}
 
     t_register_list register_list;
     t_local_stack local_stack;
@@ -75,6 +194,10 @@ struct call_frame {
     const t_chunk_pos return_address;
     const t_register_id return_value_reg;
 
+    // Set when the caller runs in another chunk (a call into a module function). Null means the same chunk.
+    const t_chunk* const return_chunk;
+    const t_literal_list* const return_literal_list;
+
     inline void reg_copy_to(const t_register_id reg, const t_register_value value) {
         register_list[reg] = value;
     }
@@ -89,22 +212,25 @@ using t_call_frame_id = uint8_t;
 
 // Execution of the thread must be done externally due to some declaration limitations.
 struct run_thread {
-    run_thread(const t_chunk& chunk)
-        : chunk(chunk) {}
+    // The chunk and literal pool being executed. Calls into module functions switch both, returns switch them back.
+    const t_chunk* chunk = nullptr;
+    const t_literal_list* literal_list = nullptr;
 
-    const t_chunk& chunk;
     t_call_stack _call_stack;
 
     t_chunk_pos ip = 0;
 
     // Initialize the thread to be execution-ready. This includes creating a default entry point function.
     // Can be called after clean_up()
-    inline void init(const t_chunk_pos start_pos) {
+    inline void init(const t_chunk& start_chunk, const t_literal_list& start_literal_list, const t_chunk_pos start_pos) {
         std::lock_guard<std::mutex> lock(_empty_mutex);
 
+        chunk = &start_chunk;
+        literal_list = &start_literal_list;
         ip = start_pos;
         _call_stack.emplace_back(0, 0);
 
+        _is_slice_ended = false;
         _is_empty = false;
     }
 
@@ -126,29 +252,116 @@ struct run_thread {
         return !_is_empty;
     }
 
+    // A suspended thread keeps its state and slot until the host runs it again with execute_thread.
+    inline bool is_suspended() const {
+        return _is_suspended.load(std::memory_order_acquire);
+    }
+
+    inline void set_suspended(const bool suspended) {
+        _is_suspended.store(suspended, std::memory_order_release);
+    }
+
+    // Charged at backward jumps and calls, as the last thing their instruction does with ip.
+    // Once fuel runs out, ip is parked past the end of any chunk, so the dispatch loop stops on its usual
+    // end of chunk check and never tests fuel itself. resume_slice puts ip back.
+    inline void burn_fuel(const int64_t amount) {
+        fuel -= amount;
+
+        if (fuel <= 0) {
+            _slice_end_ip = ip;
+            ip = SLICE_END_IP;
+            _is_slice_ended = true;
+        }
+    }
+
+    inline void resume_slice() {
+        if (_is_slice_ended) {
+            ip = _slice_end_ip;
+            _is_slice_ended = false;
+        }
+    }
+
     inline uint8_t now() const {
         if (at_eof())
             return 0;
         
-        return chunk[ip];
+        return (*chunk)[ip];
     }
 
     inline uint8_t next() {
-        if (ip >= chunk.size())
+        if (ip >= chunk->size())
             return 0;
 
-        return chunk[ip++];
+        return (*chunk)[ip++];
     }
 
     inline bool at_eof() const {
-        return ip >= chunk.size();
+        return ip >= chunk->size();
+    }
+
+    inline t_register_value lit_copy_from(const t_literal_id literal) const {
+        return (*literal_list)[literal];
     }
 
     inline call_frame& top_frame() {
         return _call_stack.back();
     }
+
+    // TLS is only ever touched by its own thread, so unlike the heap it needs no lock.
+    inline void twrite(const t_register_value address, const t_register_value value, const t_register_value bytes) {
+        _check_tls_access(address, bytes);
+
+        for (uint8_t i = 0; i < bytes; i++) {
+            tls[address + i] = bit_util::bit_cast<t_register_value, uint8_t>((value >> (i * 8)) & 0XFF);
+        }
+    }
+
+    inline t_register_value tread(const t_register_value address, const t_register_value size) {
+        _check_tls_access(address, size);
+
+        t_register_value value = 0;
+
+        for (uint8_t i = 0; i < size; i++) {
+            value |= bit_util::bit_cast<uint8_t, t_register_value>(tls[address + i]) << (i * 8);
+        }
+
+        return value;
+    }
+
+    // Records an event for the instruction at 'instruction_location'. Costs one predictable branch while tracing is off.
+    inline void trace_event(const t_chunk_pos instruction_location, const trace_kind kind, const uint32_t operand0 = 0, const uint32_t operand1 = 0) {
+        if (trace.is_enabled())
+            trace.push(instruction_location, (*chunk)[instruction_location], kind, operand0, operand1);
+    }
+
+    // Counts a run of the jump, branch or call at 'instruction_location'. 'taken' is 1 if it went to its target.
+    // Costs one predictable branch while profiling is off.
+    inline void profile_event(const t_chunk_pos instruction_location, const uint64_t taken) {
+        if (profile.is_enabled())
+            profile.record(chunk, instruction_location, taken);
+    }
+
+    thread_alloc_stats alloc_stats;
+    trace_ring trace;
+    profile_counters profile;
+
+    // Filled from the chunk's TLS template by spawn_thread. Keeps its capacity when the slot is reused.
+    t_static_memory tls;
+
+    int64_t fuel = INT64_MAX;
 private:
+    inline void _check_tls_access(const t_register_value address, const t_register_value size) const {
+        if (size > sizeof(t_register_value) || address > tls.size() || size > tls.size() - address)
+            throw vm_trap("TLS access of " + std::to_string(size) + " bytes at " + std::to_string(address) + " is out of bounds.");
+    }
+
+    static constexpr t_chunk_pos SLICE_END_IP = UINT32_MAX;
+
+    t_chunk_pos _slice_end_ip = 0;
+    bool _is_slice_ended = false;
+
     bool _is_empty = false;
+    std::atomic<bool> _is_suspended{false};
     std::mutex _empty_mutex;
 };
 
@@ -162,6 +375,18 @@ struct run_state_initializer {
     t_literal_list literal_list;
     t_static_address static_memory_size;
 
+    t_static_address tls_size = 0;
+    t_static_memory tls_template;
+
+    // Upper bound on the heap size in bytes. 0 lets the heap grow without bound.
+    t_heap_address heap_cap = 0;
+
+    run_budget budget;
+
+    // Set when running a module (see module.hpp). The chunk is then empty and threads start in module functions.
+    std::shared_ptr<module_linker> modules;
+    t_function_id entry_function = 0;
+
     t_chunk_pos ip = 0;
 
     // Use for traversing chunk to get literals.
@@ -173,27 +398,65 @@ struct run_state_initializer {
     }
 };
 
+// Everything about a loaded program that never changes while it runs.
+// Any number of run_states (isolates) can share one, each with a heap, static memory and threads of its own.
+struct run_program {
+    run_program(run_state_initializer& initializer)
+        : chunk(std::move(initializer.chunk)), literal_list(std::move(initializer.literal_list)), modules(std::move(initializer.modules)),
+          static_memory_size(initializer.static_memory_size), tls_template(std::move(initializer.tls_template)),
+          entry_ip(initializer.ip), entry_function(initializer.entry_function) {
+            tls_template.resize(initializer.tls_size);
+        }
+
+    const t_chunk chunk;
+    const t_literal_list literal_list;
+
+    // The linker loads bodies lazily, but it is thread safe, so isolates share it too.
+    const std::shared_ptr<module_linker> modules;
+
+    const t_static_address static_memory_size;
+
+    // Padded to the full segment size, so spawning a thread is a single copy.
+    t_static_memory tls_template;
+
+    // Where the main thread starts. In the chunk, or at a module function if the program is a module.
+    const t_chunk_pos entry_ip;
+    const t_function_id entry_function;
+};
+
+using p_run_program = std::shared_ptr<const run_program>;
+
 struct run_state {
     run_state(run_state_initializer& initializer)
-        : chunk(std::move(initializer.chunk)), literal_list(initializer.literal_list) {
+        : run_state(std::make_shared<const run_program>(initializer), initializer.budget, initializer.heap_cap) {}
+
+    run_state(p_run_program shared_program, const run_budget& budget, const t_heap_address heap_cap)
+        : program(std::move(shared_program)), chunk(program->chunk), literal_list(program->literal_list), modules(program->modules), budget(budget), _heap_cap(heap_cap) {
             _thread_pool.reserve(THREAD_POOL_MAX);
 
             // We don't need a mutex. This is called before any thread is detached.
-            _static_memory.reserve(initializer.static_memory_size);
+            _static_memory.resize(program->static_memory_size);
         }
-    
-    const t_chunk chunk;
-    const t_literal_list literal_list;
+
+    const p_run_program program;
+
+    const t_chunk& chunk;
+    const t_literal_list& literal_list;
+    const std::shared_ptr<module_linker> modules;
+
+    // Read by every thread at the start of each run, may be changed by the host between runs.
+    run_budget budget;
 
     inline t_register_value lit_copy_from(const t_literal_id literal) const {
         return literal_list[literal];
     }
 
+    // Suspended threads don't count, they won't finish until the host resumes them.
     inline bool are_threads_depleted() {
         std::lock_guard<std::mutex> lock(_thread_pool_mutex);
 
         for (p_run_thread& thread : _thread_pool) {
-            if (thread->is_active())
+            if (thread->is_active() && !thread->is_suspended())
                 return false;
         }
 
@@ -201,15 +464,72 @@ struct run_state {
     }
 
     // Can potentially recycle a previously finished thread just for memory efficiency.
-    run_thread& spawn_thread(const t_chunk_pos start_pos);
+    run_thread& spawn_thread(const t_chunk& start_chunk, const t_literal_list& start_literal_list, const t_chunk_pos start_pos);
+
+    inline run_thread& spawn_thread(const t_chunk_pos start_pos) {
+        return spawn_thread(chunk, literal_list, start_pos);
+    }
 
     inline run_thread& get_thread(const t_thread_id thread_id) {
         std::lock_guard<std::mutex> lock(_thread_pool_mutex);
         return *_thread_pool[thread_id];
     }
 
-    t_heap_address malloc(const uint8_t size);
-    void mfree(const t_heap_address address, const uint8_t size);
+    // Number of thread slots ever created, active or not.
+    inline size_t thread_count() {
+        std::lock_guard<std::mutex> lock(_thread_pool_mutex);
+        return _thread_pool.size();
+    }
+
+    // Walks the free set, so this is meant for occasional queries rather than hot paths.
+    heap_stats get_heap_stats();
+
+    // Returns the isolate to how it was constructed, keeping the capacity it grew: empty heap, no regions,
+    // zeroed static memory, every thread slot free and allocation, trace and profile counters at zero. Only call once no thread is running, suspended threads are dropped.
+    void reset();
+
+    // Workers of OP_PARALLEL_FOR. Created on the first parallel loop and shared by all threads of the state.
+    parallel_pool& parallel();
+
+    // Files and requests of the file instructions. Created on first use, reset() closes everything.
+    io_context& io();
+
+    // Threads spawned after this, and those already in the pool, start recording.
+    void enable_tracing(const std::string& path);
+
+    inline bool is_tracing() const {
+        return _is_tracing.load(std::memory_order_relaxed);
+    }
+
+    // Writes the trace rings of every thread to the trace path.
+    // Safe to call while threads are running, but records being written at that moment may come out torn.
+    bool dump_trace();
+
+    // Threads spawned after this, and those already in the pool, count their jumps, branches and calls in the chunk.
+    void enable_profiling(const std::string& path);
+
+    inline bool is_profiling() const {
+        return _is_profiling.load(std::memory_order_relaxed);
+    }
+
+    // For counters of threads outside the pool, like the workers of OP_PARALLEL_FOR.
+    void add_profile(const profile_counters& counters);
+
+    // Sums the counters of every thread into the profile file. Call once threads are done.
+    bool dump_profile();
+
+    // Takes the full register value, sizes past the 32 bit address space trap instead of wrapping.
+    t_heap_address malloc(const t_register_value size);
+    void mfree(const t_heap_address address, const t_heap_address size);
+
+    // Regions (arenas) reserve one block of the heap up front and bump allocate from it.
+    // Everything allocated from a region is released together, either by resetting it or by freeing the region.
+    t_region_id region_new(const t_register_value capacity);
+    // These take the id as it comes from a register and trap unless it names a live region.
+    t_heap_address region_alloc(const t_register_value region, const t_register_value size);
+    void region_reset(const t_register_value region);
+    // Returns the capacity handed back to the heap.
+    t_heap_address region_free(const t_register_value region);
 
     // 'bytes' is the number of bytes in the data that should be appended into the address space.
     void mwrite(const t_heap_address address, const t_register_value value, const uint8_t bytes);
@@ -222,13 +542,43 @@ struct run_state {
     void swrite(const t_static_address address, const t_register_value value, const uint8_t bytes);
     t_register_value sread(const t_static_address address, const uint8_t size);
 
+    // Bulk operations take each lock once and work on 'size' bytes with a single native call.
+    // Addresses and sizes are full register values, a range that leaves the memory traps.
+
+    // Traps if the ranges overlap, use mmove for those.
+    void mcopy(const t_register_value dest, const t_register_value source, const t_register_value size);
+    void mmove(const t_register_value dest, const t_register_value source, const t_register_value size);
+    void mset(const t_register_value dest, const uint8_t value, const t_register_value size);
+
+    // Behaves like memcmp, but the result is always -1, 0 or 1.
+    int mcompare(const t_register_value address0, const t_register_value address1, const t_register_value size);
+
+    void mcopy_from_static(const t_register_value dest, const t_register_value source, const t_register_value size);
+    void mcopy_to_static(const t_register_value dest, const t_register_value source, const t_register_value size);
+
+    // Copies between the heap and host memory, trapping like the rest.
+    void mread_bytes(uint8_t* dest, const t_register_value source, const t_register_value size);
+    void mwrite_bytes(const t_register_value dest, const uint8_t* source, const t_register_value size);
+
+    // Locks the heap once and hands its base pointer to 'func'. Used by bulk instructions so they don't pay a lock per element.
+    // Every { address, size } range 'func' touches must be listed in 'ranges', the view traps if one leaves the heap.
+    template <typename FUNC>
+    inline auto heap_view(const std::initializer_list<std::pair<t_register_value, t_register_value>> ranges, FUNC func) {
+        std::lock_guard<std::mutex> lock(_heap_mutex);
+
+        for (const auto& [address, size] : ranges)
+            _check_heap_range(address, size);
+
+        return func(_heap.data());
+    }
+
 private:
     struct _heap_selection {
-        _heap_selection(const t_heap_address address, const uint8_t size)
+        _heap_selection(const t_heap_address address, const t_heap_address size)
             : address(address), size(size) {};
 
         t_heap_address address;
-        uint8_t size;
+        t_heap_address size;
 
         // for hashing
         bool operator<(const _heap_selection& other) const {
@@ -236,17 +586,56 @@ private:
         }
     };
 
+    struct _heap_region {
+        _heap_region(const t_heap_address base, const t_heap_address capacity)
+            : base(base), capacity(capacity) {};
+
+        t_heap_address base;
+        t_heap_address capacity;
+        t_heap_address used = 0;
+        bool is_active = true;
+    };
+
     std::vector<uint8_t> _static_memory;
     std::mutex _static_memory_mutex;
 
     t_heap _heap;
     std::mutex _heap_mutex;
 
+    const t_heap_address _heap_cap;
+
     std::set<_heap_selection> _free_heap_space_set;
     std::mutex _free_heap_space_set_mutex;
 
+    std::vector<_heap_region> _region_list;
+    std::mutex _region_list_mutex;
+
+    // Caller holds _region_list_mutex.
+    _heap_region& _active_region(const t_register_value region);
+
+    // Caller holds the lock of the memory being checked.
+    void _check_heap_range(const t_register_value address, const t_register_value size) const;
+    void _check_static_range(const t_register_value address, const t_register_value size) const;
+
     t_thread_pool _thread_pool;
     std::mutex _thread_pool_mutex;
+
+    std::shared_ptr<parallel_pool> _parallel_pool;
+    std::once_flag _parallel_pool_once;
+
+    std::shared_ptr<io_context> _io_context;
+    std::mutex _io_context_mutex;
+
+    std::atomic<bool> _is_tracing{false};
+    std::string _trace_path;
+    uint64_t _trace_start_ticks = 0;
+    std::chrono::steady_clock::time_point _trace_start_time;
+    std::mutex _trace_dump_mutex;
+
+    std::atomic<bool> _is_profiling{false};
+    std::string _profile_path;
+    std::vector<profile_site> _profile_sites;
+    std::mutex _profile_mutex;
 };
 
 static inline uint16_t _call_mergel_16(const t_chunk& chunk, t_chunk_pos& ip) {
@@ -36,15 +36,98 @@ enum opcode {
                      //                                         sets thread ip to current ip + OFFSET
                      //                                         loads ARGS registers (A...) into local stack of thread's main call frame.  
 
-    OP_RETURN,       // A: REG?                                 Closes current call stack, writes A to X register of lower call stack if a return register was specified.
+    OP_RETURN,       // A: REG                                  Closes current call stack, writes A to X register of lower call stack if a return register was specified.
+                     //                                         A is always encoded, even when nothing reads it.
 
     OP_JUMP_I8,      // OFFSET: i8
     OP_JUMP_I16,     // OFFSET: i16
 
-    OP_JUMP_IF_FALSE,// OFFSET: i16, A: REG                     Jumps IP by offset if A is falsey.
+    OP_JUMP_IF_FALSE,// A: REG, OFFSET: i16                     Jumps IP by offset if A is falsey.
 
     OP_U_NOT,        // A: REG, B: REG                          Flips little bit of B, writes to A.
     OP_U_NEG,        // A: REG, B: REG                          Flips sign bit of B, writes to A.
+
+    OP_V_ADD,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG Adds (N) elements of TYPE at heap addresses (B) and (C),
+                     //                                         stores the (N) results at heap address (A).
+    OP_V_SUB,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_MUL,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_DIV,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_MIN,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_MAX,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_MORE,       // TYPE: 8, A: REG, B: REG, C: REG, N: REG Comparisons store 1 or 0 per element as a TYPE value.
+    OP_V_LESS,       // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+    OP_V_EQUAL,      // TYPE: 8, A: REG, B: REG, C: REG, N: REG
+
+    OP_V_SUM,        // TYPE: 8, A: REG, B: REG, N: REG         Sums (N) elements of TYPE at heap address (B), stores result in (A).
+    OP_V_RMIN,       // TYPE: 8, A: REG, B: REG, N: REG         Smallest of (N) elements at heap address (B), stores result in (A).
+    OP_V_RMAX,       // TYPE: 8, A: REG, B: REG, N: REG         Largest of (N) elements at heap address (B), stores result in (A).
+    OP_V_DOT,        // TYPE: 8, A: REG, B: REG, C: REG, N: REG Dot product of (N) elements at heap addresses (B) and (C), stores result in (A).
+
+    OP_MCOPY,        // A: REG, B: REG, C: REG                  Copies (C) bytes from heap address (B) to heap address (A). Traps if the ranges overlap.
+    OP_MMOVE,        // A: REG, B: REG, C: REG                  Same as OP_MCOPY, but ranges may overlap.
+    OP_MSET,         // A: REG, B: REG, C: REG                  Fills (C) bytes at heap address (A) with the low byte of (B).
+    OP_MCMP,         // A: REG, B: REG, C: REG, D: REG          Compares (D) bytes at heap addresses (B) and (C), stores -1, 0 or 1 as I64 in (A).
+    OP_MCOPY_FROM_STATIC,// A: REG, B: REG, C: REG                  Copies (C) bytes from static address (B) to heap address (A).
+    OP_MCOPY_TO_STATIC,// A: REG, B: REG, C: REG                  Copies (C) bytes from heap address (B) to static address (A).
+
+    OP_LOAD_IMM8,    // A: REG, IMM: 8                          Load IMM into (A), zero extended.
+    OP_LOAD_IMM16,   // A: REG, IMM: 16
+    OP_LOAD_IMM32,   // A: REG, IMM: 32
+    OP_LOAD_IMM64,   // A: REG, IMM: 64
+
+    OP_B_ADD_IMM,    // TYPE: 8, A: REG, B: REG, IMM: i16       Add (B) and IMM with type TYPE, store result in (A).
+                     //                                         IMM is converted to TYPE by value, so it works for floats too.
+    OP_B_SUB_IMM,    // TYPE: 8, A: REG, B: REG, IMM: i16
+    OP_B_MUL_IMM,    // TYPE: 8, A: REG, B: REG, IMM: i16
+    OP_B_DIV_IMM,    // TYPE: 8, A: REG, B: REG, IMM: i16
+    OP_B_MORE_IMM,   // TYPE: 8, A: REG, B: REG, IMM: i16
+    OP_B_LESS_IMM,   // TYPE: 8, A: REG, B: REG, IMM: i16
+    OP_B_EQUAL_IMM,  // TYPE: 8, A: REG, B: REG, IMM: i16       Unlike OP_B_EQUAL, this compares by value with type TYPE.
+
+    OP_JUMP_IF_NOT_LESS_IMM,// TYPE: 8, A: REG, IMM: i16, OFFSET: i16  Jumps IP by OFFSET unless (A) < IMM with type TYPE.
+    OP_JUMP_IF_NOT_MORE_IMM,// TYPE: 8, A: REG, IMM: i16, OFFSET: i16  Jumps IP by OFFSET unless (A) > IMM with type TYPE.
+    OP_JUMP_IF_NOT_EQUAL_IMM,// TYPE: 8, A: REG, IMM: i16, OFFSET: i16  Jumps IP by OFFSET unless (A) == IMM with type TYPE.
+
+    OP_TAIL_CALL,    // OFFSET: i32, ARGS: 8, B: REG...         Reuses the current call frame,
+                     //                                         replaces its local stack with ARGS registers (B...),
+                     //                                         moves ip by OFFSET.
+                     //                                         The return address and return register of the frame are kept.
+
+    OP_REGION_NEW,   // A: REG, B: REG                          Reserves (B) bytes of heap as a new region, stores the region id in (A).
+    OP_REGION_ALLOC, // A: REG, B: REG, C: REG                  Bump allocates (C) bytes from region (B), stores address in (A).
+    OP_REGION_RESET, // A: REG                                  Releases every allocation of region (A) at once, keeping its memory.
+    OP_REGION_FREE,  // A: REG                                  Returns region (A) and everything allocated from it to the heap.
+
+    OP_HEAP_STAT,    // A: REG, STAT: 8                         Stores the heap_stat STAT in (A). Thread stats are those of the calling thread.
+
+    OP_CALL_FN,      // FN: 16, A: REG, ARGS: 8, B: REG...      Same as OP_CALL, but calls function FN of the module table.
+                     //                                         The body is loaded, verified and linked on first call.
+    OP_DESYNC_FN,    // FN: 16, ARGS: 8, A: REG...              Same as OP_DESYNC, but the thread starts at function FN.
+
+    OP_TREAD,        // A: REG, B: REG, C: REG                  Reads (C) bytes at TLS address (A) of the calling thread, stores in (B).
+    OP_TWRITE,       // A: REG, B: REG, C: REG                  Writes first (C) bytes of (B) to TLS address (A) of the calling thread.
+                     //                                         Both trap if the access leaves the segment or (C) is over 8.
+
+    OP_PARALLEL_FOR, // OFFSET: i32, A: REG, B: REG, C: REG, D: REG, TYPE: 8, OP: 8, ARGS: 8, E: REG...
+                     //                                         Calls the function at ip + OFFSET once for every I64 index in [(A), (B)),
+                     //                                         with the index as local 0 and ARGS registers (E...) after it.
+                     //                                         Iterations run on the parallel pool in batches of (C) indices.
+                     //                                         Returns once every iteration is done. A trap in any of them traps here.
+                     //                                         If D > 0, the returned values are combined with reduction OP
+                     //                                         and type TYPE, and the result is written to (D - 1). 0 for no iterations.
+
+    OP_FOPEN,        // A: REG, B: REG, C: REG, MODE: 8         Opens the file named by the (C) bytes at heap address (B) with file_mode MODE.
+                     //                                         Stores the file handle in (A), or -errno as I64 if it fails.
+    OP_FCLOSE,       // A: REG, B: REG                          Closes file handle (B), stores 0 or -errno as I64 in (A).
+    OP_FREAD,        // A: REG, B: REG, C: REG, D: REG, E: REG  Starts reading up to (D) bytes at offset (E) of file (B) into heap address (C).
+                     //                                         Stores a request id in (A) and continues without waiting.
+    OP_FWRITE,       // A: REG, B: REG, C: REG, D: REG, E: REG  Starts writing (D) bytes from heap address (C) to offset (E) of file (B).
+                     //                                         The bytes are taken when the instruction runs. Stores a request id in (A).
+    OP_IO_WAIT,      // A: REG, B: REG                          Suspends the calling thread until request (B) is done, other threads keep running.
+                     //                                         Stores bytes transferred or -errno as I64 in (A). Read data reaches the heap here.
+                     //                                         All file instructions trap unless the host allows file I/O in the run budget.
+
+    OP_JUMP_IF_TRUE, // A: REG, OFFSET: i16                     Jumps IP by offset if A is truthy. Lets layout invert OP_JUMP_IF_FALSE.
 };
 
 enum value_type : uint8_t {
@@ -63,6 +146,38 @@ enum value_type : uint8_t {
     VAL_F64,
 };
 
+// Combines the results of OP_PARALLEL_FOR iterations. The order they combine in is unspecified, which matters for floats.
+enum reduction : uint8_t {
+    REDUCTION_ADD,
+    REDUCTION_MUL,
+    REDUCTION_MIN,
+    REDUCTION_MAX,
+};
+
+enum file_mode : uint8_t {
+    FILE_READ,
+    FILE_WRITE,      // Creates the file, or truncates it.
+    FILE_APPEND,     // Creates the file. Writes go to its end whatever their offset.
+    FILE_READ_WRITE, // Creates the file, keeping what is there.
+};
+
+enum heap_stat : uint8_t {
+    STAT_HEAP_SIZE,
+    STAT_LIVE_BYTES,
+    STAT_FREE_BYTES,
+    STAT_LARGEST_FREE_BLOCK,
+    STAT_FREE_BLOCK_COUNT,
+    STAT_HEAP_CAP,
+
+    STAT_THREAD_ALLOC_COUNT,
+    STAT_THREAD_FREE_COUNT,
+    STAT_THREAD_ALLOC_BYTES,
+    STAT_THREAD_FREE_BYTES,
+
+    // STAT_THREAD_HISTOGRAM + i reads bucket i of the calling thread's allocation size histogram.
+    STAT_THREAD_HISTOGRAM,
+};
+
 void instr_out(run_state& state, run_thread& thread, call_frame& top_frame);
 void instr_load(run_state& state, run_thread& thread, call_frame& top_frame);
 void instr_binary_add(run_state& state, run_thread& thread, call_frame& top_frame);
@@ -86,6 +201,60 @@ void instr_jump_i16(run_state& state, run_thread& thread, call_frame& top_frame)
 void instr_jump_if_false(run_state& state, run_thread& thread, call_frame& top_frame);
 void instr_unary_not(run_state& state, run_thread& thread, call_frame& top_frame);
 void instr_unary_neg(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_add(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_sub(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_mul(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_div(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_min(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_max(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_more(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_less(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_equal(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_sum(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_rmin(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_rmax(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_vector_dot(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mcopy(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mmove(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mset(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mcompare(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mcopy_from_static(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_mcopy_to_static(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_load_imm8(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_load_imm16(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_load_imm32(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_load_imm64(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_add_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_sub_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_mul_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_div_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_more_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_less_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_binary_equal_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_jump_if_not_less_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_jump_if_not_more_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_jump_if_not_equal_imm(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_tail_call(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_region_new(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_region_alloc(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_region_reset(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_region_free(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_heap_stat(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_call_fn(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_desync_fn(run_state& state, run_thread& thread, call_frame& top_frame);
+
+void instr_tread(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_twrite(run_state& state, run_thread& thread, call_frame& top_frame);
+
+void instr_parallel_for(run_state& state, run_thread& thread, call_frame& top_frame);
+
+void instr_fopen(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_fclose(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_fread(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_fwrite(run_state& state, run_thread& thread, call_frame& top_frame);
+void instr_io_wait(run_state& state, run_thread& thread, call_frame& top_frame);
+
+void instr_jump_if_true(run_state& state, run_thread& thread, call_frame& top_frame);
 
 // Functions must carry the same order as their enum equiv
 void (*const instruction_jump_table[])(run_state&, run_thread&, call_frame&) = { 
@@ -111,7 +280,61 @@ void (*const instruction_jump_table[])(run_state&, run_thread&, call_frame&) = {
     instr_jump_i16,
     instr_jump_if_false,
     instr_unary_not,
-    instr_unary_neg
+    instr_unary_neg,
+    instr_vector_add,
+    instr_vector_sub,
+    instr_vector_mul,
+    instr_vector_div,
+    instr_vector_min,
+    instr_vector_max,
+    instr_vector_more,
+    instr_vector_less,
+    instr_vector_equal,
+    instr_vector_sum,
+    instr_vector_rmin,
+    instr_vector_rmax,
+    instr_vector_dot,
+    instr_mcopy,
+    instr_mmove,
+    instr_mset,
+    instr_mcompare,
+    instr_mcopy_from_static,
+    instr_mcopy_to_static,
+    instr_load_imm8,
+    instr_load_imm16,
+    instr_load_imm32,
+    instr_load_imm64,
+    instr_binary_add_imm,
+    instr_binary_sub_imm,
+    instr_binary_mul_imm,
+    instr_binary_div_imm,
+    instr_binary_more_imm,
+    instr_binary_less_imm,
+    instr_binary_equal_imm,
+    instr_jump_if_not_less_imm,
+    instr_jump_if_not_more_imm,
+    instr_jump_if_not_equal_imm,
+    instr_tail_call,
+    instr_region_new,
+    instr_region_alloc,
+    instr_region_reset,
+    instr_region_free,
+    instr_heap_stat,
+    instr_call_fn,
+    instr_desync_fn,
+    instr_tread,
+    instr_twrite,
+    instr_parallel_for,
+    instr_fopen,
+    instr_fclose,
+    instr_fread,
+    instr_fwrite,
+    instr_io_wait,
+    instr_jump_if_true
 };
 
-void execute_thread(run_state& state, run_thread& thread);
\ No newline at end of file
+void execute_thread(run_state& state, run_thread& thread);
+
+// Calls the function at 'entry' on 'thread' with 'locals', and runs it until it returns. The thread is free again afterwards.
+// Returns false if the run budget ran out first. vm_trap propagates to the caller.
+bool execute_call(run_state& state, run_thread& thread, const t_chunk& chunk, const t_literal_list& literal_list, const t_chunk_pos entry, const t_local_stack& locals, t_register_value& result);
\ No newline at end of file
@@ -0,0 +1,107 @@
+#pragma once
+
+#include <condition_variable>
+#include <unordered_map>
+
+#include "core.hpp"
+
+// Use io_uring where the kernel offers it. When this is off, or setup fails, requests run on IO_WORKER_COUNT threads instead.
+constexpr bool IO_URING_ENABLED = true;
+constexpr uint32_t IO_RING_ENTRIES = 64;
+constexpr size_t IO_WORKER_COUNT = 4;
+
+// Open files per run_state.
+constexpr size_t IO_FILE_MAX = 256;
+
+// Largest single read or write, it bounds the buffer a request holds.
+constexpr uint32_t IO_TRANSFER_MAX = 64 * 1024 * 1024;
+
+enum io_kind : uint8_t {
+    IO_OPEN,
+    IO_CLOSE,
+    IO_READ,
+    IO_WRITE,
+};
+
+// One file operation in flight. The data goes through a buffer owned by the request rather than the heap itself,
+// since the heap moves whenever it grows and the kernel may still be writing into it.
+struct io_request {
+    io_kind kind;
+    int fd = -1;
+    int flags = 0;
+    uint64_t offset = 0;
+
+    std::string path;
+    std::vector<uint8_t> buffer;
+
+    // Where read data is copied to once the request is waited on.
+    t_register_value heap_address = 0;
+
+    // Called exactly once by the backend, from any thread.
+    inline void complete(const int64_t result) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _result = result;
+        _is_done = true;
+        _condition.notify_all();
+    }
+
+    // Returns what the operation returned: a file descriptor, bytes transferred, or -errno.
+    inline int64_t wait() {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [&] { return _is_done; });
+        return _result;
+    }
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    bool _is_done = false;
+    int64_t _result = 0;
+};
+
+class io_backend {
+public:
+    virtual ~io_backend() = default;
+
+    // Starts 'request', which must stay alive until it completes.
+    virtual void submit(io_request& request) = 0;
+
+    virtual const char* name() const = 0;
+};
+
+// Files and pending requests of one run_state. Handles given to bytecode index a table of their own,
+// so bytecode can only reach files it opened.
+class io_context {
+public:
+    io_context();
+
+    // Waits for requests still in flight, then closes every file left open.
+    ~io_context();
+
+    // Blocks until the file is open. Returns the handle, or -errno.
+    int64_t open(const std::string& path, const uint8_t mode);
+
+    // Waits for requests on the file, then closes it. Returns 0 or -errno.
+    int64_t close(const uint64_t file);
+
+    // Both return a request id right away, see take_request.
+    uint64_t submit_read(const uint64_t file, const t_register_value address, const uint32_t size, const uint64_t offset);
+    uint64_t submit_write(const uint64_t file, std::vector<uint8_t> data, const uint64_t offset);
+
+    // Hands a request over to be waited on. An id can only be taken once.
+    std::shared_ptr<io_request> take_request(const uint64_t request_id);
+
+    inline const char* backend_name() const {
+        return _backend != nullptr ? _backend->name() : "none";
+    }
+private:
+    int _fd(const uint64_t file);
+    uint64_t _submit(std::shared_ptr<io_request> request);
+
+    std::unique_ptr<io_backend> _backend;
+
+    std::vector<int> _file_table;
+    std::unordered_map<uint64_t, std::shared_ptr<io_request>> _pending_map;
+    uint64_t _next_request_id = 1;
+
+    std::mutex _mutex;
+};
@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+
+#include "core.hpp"
+
+// Spawns the main thread of the program at its entry, in the chunk or in the entry function of a module.
+run_thread& spawn_entry_thread(run_state& state);
+
+// Runs the program from its entry and waits for every thread it started.
+// Returns false if the main thread was suspended by its run budget.
+bool run_isolate(run_state& state);
+
+class isolate_pool;
+
+// An isolate borrowed from an isolate_pool. It goes back to the pool when the lease is destroyed.
+class isolate_lease {
+public:
+    isolate_lease(isolate_pool& pool, std::unique_ptr<run_state> isolate)
+        : _pool(&pool), _isolate(std::move(isolate)) {}
+
+    isolate_lease(isolate_lease&& other) = default;
+    isolate_lease& operator=(isolate_lease&& other) = delete;
+
+    ~isolate_lease();
+
+    inline run_state& operator*() const {
+        return *_isolate;
+    }
+
+    inline run_state* operator->() const {
+        return _isolate.get();
+    }
+private:
+    isolate_pool* _pool;
+    std::unique_ptr<run_state> _isolate;
+};
+
+// Hands out isolates of one shared program to host worker threads. Each isolate has its own heap, static memory
+// and threads, while the chunk, literals and module table exist once for the whole pool.
+// Isolates are created on demand up to 'isolate_max', and reset when they come back so every lease starts clean.
+class isolate_pool {
+public:
+    isolate_pool(p_run_program program, const run_budget& budget, const t_heap_address heap_cap, const size_t isolate_max)
+        : _program(std::move(program)), _budget(budget), _heap_cap(heap_cap), _isolate_max(isolate_max) {}
+
+    // Waits for an isolate to come back if all of them are leased out.
+    isolate_lease acquire();
+
+    inline const p_run_program& program() const {
+        return _program;
+    }
+private:
+    friend class isolate_lease;
+
+    // Waits for threads the lease holder left running, then resets the isolate for the next lease.
+    void _release(std::unique_ptr<run_state> isolate);
+
+    const p_run_program _program;
+    const run_budget _budget;
+    const t_heap_address _heap_cap;
+    const size_t _isolate_max;
+
+    std::vector<std::unique_ptr<run_state>> _free_list;
+    size_t _isolate_count = 0;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+};
@@ -0,0 +1,143 @@
+#pragma once
+
+#include <filesystem>
+#include <fstream>
+#include <unordered_map>
+#include <optional>
+
+#include "core.hpp"
+
+/*
+
+MODULE (.lcm)
+    4 bytes - Magic "LMOD"
+    32 bits - Header size (bytes, magic included). Function bodies are never part of the header.
+    32 bits - Static memory size. Static memory belongs to the program, so only the entry module's is used.
+    16 bits - Number of literals
+
+        LITERAL
+            1 byte  - Literal Size (bytes)
+            x bytes - Literal binary
+
+    16 bits - Number of imports
+
+        IMPORT
+            1 byte  - Module name length
+            x bytes - Module name, looked up as <entry module directory>/<name>.lcm
+            1 byte  - Symbol length
+            x bytes - Symbol, the name of a function exported by that module
+
+    16 bits - Number of functions
+
+        FUNCTION
+            1 byte  - Name length, 0 keeps the function private
+            x bytes - Name, named functions are exported
+            32 bits - Body offset (from the start of the file)
+            32 bits - Body size (bytes)
+
+    x bytes - Function bodies
+
+Only headers are read when a module is loaded. A body is read, verified and linked the first time it is called.
+Bodies are self contained chunks, offsets in them are relative to the body and OP_LOAD indexes the literals of its module.
+Inside a body, FN operands index the module's functions first and its imports after them. Linking rewrites them
+in place to ids of the program wide function table, so a call only resolves its target once.
+
+Imported modules are loaded when a body that calls into them is linked. The entry module starts at its function named "main".
+*/
+
+constexpr auto FUNCTION_TABLE_MAX = UINT16_MAX + 1;
+constexpr auto FUNCTION_PAGE_SIZE = 256;
+constexpr auto MODULE_EXTENSION = ".lcm";
+constexpr auto MODULE_ENTRY_FUNCTION = "main";
+
+struct loaded_module;
+
+struct function_entry {
+    std::string name;
+    loaded_module* owner = nullptr;
+
+    uint32_t body_offset = 0;
+    uint32_t body_size = 0;
+
+    // Published once the body is loaded, verified and linked. Never changes after that.
+    std::atomic<const t_chunk*> body{nullptr};
+    std::unique_ptr<t_chunk> body_storage;
+};
+
+struct loaded_module {
+    struct import {
+        std::string module_name;
+        std::string symbol;
+        std::optional<t_function_id> resolved_id;
+    };
+
+    std::string name;
+    std::ifstream file;
+
+    t_static_address static_memory_size = 0;
+    t_literal_list literal_list;
+
+    std::vector<import> import_list;
+    std::unordered_map<std::string, t_function_id> export_map;
+
+    // Global ids of a module's functions are contiguous.
+    t_function_id first_function = 0;
+    uint16_t function_count = 0;
+};
+
+// Program wide function table. Threads read it without locking, only loading takes the lock.
+class module_linker {
+public:
+    // Modules imported by name are looked up in 'search_directory'.
+    module_linker(const std::filesystem::path& search_directory)
+        : _search_directory(search_directory) {}
+
+    // Loads the header of the entry module, returns the id of its entry function. Throws vm_trap if the module is malformed.
+    t_function_id load_entry(const std::filesystem::path& path);
+
+    inline t_static_address static_memory_size() const {
+        return _module_list.empty() ? 0 : _module_list.front()->static_memory_size;
+    }
+
+    inline const function_entry& function(const t_function_id id) const {
+        return _function_pages[id / FUNCTION_PAGE_SIZE][id % FUNCTION_PAGE_SIZE];
+    }
+
+    // The first call for a function loads, verifies and links its body, and throws vm_trap if any of that fails.
+    inline const t_chunk& body(const t_function_id id) {
+        const t_chunk* body = function(id).body.load(std::memory_order_acquire);
+
+        if (body)
+            return *body;
+
+        return _load_body(id);
+    }
+
+    inline const t_literal_list& literal_list(const t_function_id id) const {
+        return function(id).owner->literal_list;
+    }
+
+private:
+    loaded_module& _load_module(const std::string& name, const std::filesystem::path& path);
+    const t_chunk& _load_body(const t_function_id id);
+    void _link_body(loaded_module& module, const function_entry& function, t_chunk& body);
+    t_function_id _resolve_import(loaded_module& module, const uint16_t import);
+
+    inline function_entry& _function(const t_function_id id) {
+        return _function_pages[id / FUNCTION_PAGE_SIZE][id % FUNCTION_PAGE_SIZE];
+    }
+
+    const std::filesystem::path _search_directory;
+
+    std::vector<std::unique_ptr<loaded_module>> _module_list;
+    std::unordered_map<std::string, loaded_module*> _module_map;
+
+    // Pages never move once allocated, so a reader can index the table while another thread appends to it.
+    std::array<std::unique_ptr<function_entry[]>, FUNCTION_TABLE_MAX / FUNCTION_PAGE_SIZE> _function_pages;
+    uint32_t _function_count = 0;
+
+    std::mutex _mutex;
+};
+
+// Whether the file at 'path' starts with the module magic.
+bool is_module_file(const std::filesystem::path& path);
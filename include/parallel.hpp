@@ -0,0 +1,49 @@
+#pragma once
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+
+#include "core.hpp"
+
+// Upper bound on the workers of a parallel_pool. The thread that issues a loop always works on it as well.
+constexpr size_t PARALLEL_WORKER_MAX = THREAD_POOL_MAX;
+
+// Persistent OS threads behind OP_PARALLEL_FOR. Workers start on the first loop and sleep while there is nothing to do.
+// A loop is split into batches that workers and the issuing thread claim one at a time. A loop issued from inside
+// a batch of another one still finishes, since its issuer works through it even if every worker is busy.
+class parallel_pool {
+public:
+    // Runs indices [begin, end) of a batch. Must not throw, and is called concurrently for different batches.
+    using t_batch_func = std::function<void(const uint64_t begin, const uint64_t end)>;
+
+    ~parallel_pool();
+
+    // Splits [0, count) into batches of 'grain' indices and returns once every batch has run.
+    void run(const uint64_t count, const uint64_t grain, const t_batch_func& func);
+private:
+    struct _job {
+        const t_batch_func* func;
+        uint64_t count;
+        uint64_t grain;
+        uint64_t batch_count;
+
+        std::atomic<uint64_t> next_batch{0};
+
+        uint64_t done_batches = 0;
+        std::mutex done_mutex;
+        std::condition_variable done_condition;
+    };
+
+    // Claims and runs batches of 'job' until none are left.
+    static void _work_on(_job& job);
+
+    void _worker_loop();
+
+    std::vector<std::thread> _workers;
+    std::deque<std::shared_ptr<_job>> _job_queue;
+    bool _is_stopping = false;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+};
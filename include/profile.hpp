@@ -0,0 +1,89 @@
+#pragma once
+
+#include <algorithm>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+/*
+
+PROFILE FILE
+    4 bytes - Magic "LVPF"
+    32 bits - Version
+    32 bits - Size of the profiled chunk in bytes
+    64 bits - FNV-1a hash of the profiled chunk
+    32 bits - Number of sites
+
+        SITE
+            32 bits - Position of the instruction in the chunk
+            64 bits - Times it ran
+            64 bits - Times it transferred control to its target. OP_PARALLEL_FOR counts every iteration.
+
+All values are little endian. Only sites that ran are written, in order of position.
+A profile only describes the chunk it was recorded on, livm-opt checks the size and hash before using one.
+*/
+
+constexpr char PROFILE_MAGIC[] = { 'L', 'V', 'P', 'F' };
+constexpr uint32_t PROFILE_VERSION = 1;
+
+// Sites are instructions with a relative code operand: jumps, branches and calls.
+// Their counts are enough to recover how often every basic block ran.
+struct profile_site {
+    uint64_t executed = 0;
+    uint64_t taken = 0;
+};
+
+static inline uint64_t profile_chunk_hash(const std::vector<uint8_t>& chunk) {
+    uint64_t hash = 14695981039346656037ull;
+
+    for (const uint8_t byte : chunk)
+        hash = (hash ^ byte) * 1099511628211ull;
+
+    return hash;
+}
+
+// Site counters of one thread, indexed by position in the profiled chunk.
+// The owning thread is the only writer, so counting is two plain adds.
+struct profile_counters {
+    inline bool is_enabled() const {
+        return _sites != nullptr;
+    }
+
+    // Once enabled, counters stay enabled for the life of the thread slot and keep counting across reuse.
+    inline void enable(const std::vector<uint8_t>& chunk) {
+        if (_sites)
+            return;
+
+        _chunk = &chunk;
+        _sites = std::make_unique<profile_site[]>(chunk.size());
+    }
+
+    // Code of module functions lives in chunks of its own and is not counted.
+    inline void record(const std::vector<uint8_t>* chunk, const uint32_t position, const uint64_t taken) {
+        if (chunk != _chunk)
+            return;
+
+        _sites[position].executed++;
+        _sites[position].taken += taken;
+    }
+
+    // Zeroes the counts but keeps counting enabled. Only while the owning thread is stopped.
+    inline void clear() {
+        if (_sites)
+            std::fill(_sites.get(), _sites.get() + _chunk->size(), profile_site());
+    }
+
+    // 'sites' must be the size of the profiled chunk.
+    inline void add_to(std::vector<profile_site>& sites) const {
+        if (!_sites)
+            return;
+
+        for (size_t i = 0; i < sites.size(); i++) {
+            sites[i].executed += _sites[i].executed;
+            sites[i].taken += _sites[i].taken;
+        }
+    }
+private:
+    const std::vector<uint8_t>* _chunk = nullptr;
+    std::unique_ptr<profile_site[]> _sites;
+};
@@ -0,0 +1,47 @@
+#pragma once
+
+#include <cstdint>
+#include <cstddef>
+
+#include "instructions.hpp"
+
+/*
+
+SIMD
+    Kernels for the vector instructions. Each kernel walks packed arrays of a single value_type.
+    The widest kernel the CPU supports is picked once at runtime (AVX2 -> SSE -> scalar).
+    Tails that don't fill a full vector are always handled by the scalar loop.
+*/
+
+namespace simd {
+    enum vector_op : uint8_t {
+        VEC_ADD,
+        VEC_SUB,
+        VEC_MUL,
+        VEC_DIV,
+        VEC_MIN,
+        VEC_MAX,
+        VEC_MORE,  // Writes 1 or 0 as a value of the type, so 1.0 for floats.
+        VEC_LESS,
+        VEC_EQUAL,
+    };
+
+    enum reduce_op : uint8_t {
+        RED_SUM,
+        RED_MIN,
+        RED_MAX,
+    };
+
+    // Size in bytes of one element of 'type', or 0 if the kernels don't support it.
+    size_t element_size(const value_type type);
+
+    // Applies 'op' to 'count' elements of 'a' and 'b', writes 'count' elements to 'dest'.
+    // 'dest' may alias 'a' or 'b' exactly, but must not partially overlap them.
+    void binary(const value_type type, const vector_op op, uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count);
+
+    // Reduces 'count' elements of 'src' to a single value. Empty ranges reduce to 0.
+    t_register_value reduce(const value_type type, const reduce_op op, const uint8_t* src, const size_t count);
+
+    // Sum of the element-wise products of 'a' and 'b'.
+    t_register_value dot(const value_type type, const uint8_t* a, const uint8_t* b, const size_t count);
+}
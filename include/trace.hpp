@@ -0,0 +1,126 @@
+#pragma once
+
+#include <cstdint>
+#include <atomic>
+#include <memory>
+#include <chrono>
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+#endif
+
+/*
+
+TRACE FILE
+    4 bytes - Magic "LVTR"
+    32 bits - Version
+    64 bits - Ticks per second (f64)
+    8 bits  - Number of threads
+
+        THREAD
+            8 bits  - Thread id
+            32 bits - Number of records
+            x bytes - Records, oldest first
+
+All values are little endian, records are written as the trace_record struct below.
+*/
+
+constexpr uint32_t TRACE_VERSION = 1;
+
+// Events kept per thread. Must be a power of two.
+constexpr uint32_t TRACE_RING_SIZE = 4096;
+
+// Events between clock reads. Must be a power of two.
+constexpr uint32_t TRACE_CLOCK_INTERVAL = 64;
+
+// Only control transfers and memory events are recorded. Code between two records runs straight through,
+// so the chunk fills in every instruction that ran in between.
+enum trace_kind : uint8_t {
+    TRACE_JUMP,     // OPERAND0: target ip. Only taken jumps are recorded.
+    TRACE_CALL,     // OPERAND0: target ip, OPERAND1: return register
+    TRACE_TAIL_CALL,// OPERAND0: target ip, OPERAND1: return register of the reused frame
+    TRACE_DESYNC,   // OPERAND0: target ip, OPERAND1: argument count
+    TRACE_MALLOC,   // OPERAND0: address, OPERAND1: size
+    TRACE_MFREE,    // OPERAND0: address, OPERAND1: size
+    TRACE_RETURN,   // OPERAND0: return address
+    TRACE_TRAP,     // ip is where the thread stopped.
+};
+
+struct trace_record {
+    uint64_t timestamp;
+    uint32_t ip;
+    uint8_t opcode;
+    trace_kind kind;
+    uint16_t reserved;
+    uint32_t operand0;
+    uint32_t operand1;
+};
+
+static_assert(sizeof(trace_record) == 24, "The trace file format relies on the record layout.");
+
+// Cheapest monotonic-enough clock available. On x86 this is the TSC, converted to time once, when the trace is dumped.
+static inline uint64_t trace_clock() {
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    return std::chrono::steady_clock::now().time_since_epoch().count();
+#endif
+}
+
+// Fixed size ring of the last TRACE_RING_SIZE events of one thread.
+// The owning thread is the only writer, so pushing is a few plain stores plus a release of the head.
+// Readers copy the records below the head, a live read may race with records being overwritten.
+struct trace_ring {
+    inline bool is_enabled() const {
+        return _records != nullptr;
+    }
+
+    // Allocates the ring. Once enabled, a ring stays enabled for the life of the thread slot.
+    inline void enable() {
+        if (!_records)
+            _records = std::make_unique<trace_record[]>(TRACE_RING_SIZE);
+    }
+
+    // Reading the clock costs about as much as a few dispatches, so it is only read every TRACE_CLOCK_INTERVAL events.
+    // Events in between share the last reading.
+    inline void push(const uint32_t ip, const uint8_t opcode, const trace_kind kind, const uint32_t operand0, const uint32_t operand1) {
+        const uint64_t head = _head.load(std::memory_order_relaxed);
+
+        if ((head & (TRACE_CLOCK_INTERVAL - 1)) == 0 || kind == TRACE_TRAP)
+            _last_timestamp = trace_clock();
+
+        trace_record& record = _records[head & (TRACE_RING_SIZE - 1)];
+        record.timestamp = _last_timestamp;
+        record.ip = ip;
+        record.opcode = opcode;
+        record.kind = kind;
+        record.operand0 = operand0;
+        record.operand1 = operand1;
+
+        _head.store(head + 1, std::memory_order_release);
+    }
+
+    // Drops every record but keeps the ring allocated. Only while the owning thread is stopped.
+    inline void clear() {
+        _head.store(0, std::memory_order_release);
+        _last_timestamp = 0;
+    }
+
+    // Copies the retained records into 'out', oldest first. Returns the number of records copied.
+    inline uint32_t copy_to(trace_record* out) const {
+        if (!_records)
+            return 0;
+
+        const uint64_t head = _head.load(std::memory_order_acquire);
+        const uint64_t count = head < TRACE_RING_SIZE ? head : TRACE_RING_SIZE;
+
+        for (uint64_t i = 0; i < count; i++)
+            out[i] = _records[(head - count + i) & (TRACE_RING_SIZE - 1)];
+
+        return count;
+    }
+private:
+    std::unique_ptr<trace_record[]> _records;
+    std::atomic<uint64_t> _head{0};
+    uint64_t _last_timestamp = 0;
+};
@@ -0,0 +1,124 @@
+#pragma once
+
+#include <limits>
+#include <type_traits>
+
+#include "instructions.hpp"
+
+/*
+
+TYPED OPERATIONS
+    Arithmetic of the typed instructions, shared by the interpreter and livm-opt so constant folding computes exactly what a run would.
+    Operands are reinterpreted as the operation's type, results are zero extended back into a register.
+*/
+
+inline constexpr auto _typed_binary_add = [](auto a, auto b) { return a + b; };
+inline constexpr auto _typed_binary_sub = [](auto a, auto b) { return a - b; };
+inline constexpr auto _typed_binary_mul = [](auto a, auto b) { return a * b; };
+inline constexpr auto _typed_binary_div = [](auto a, auto b) { return a / b; };
+inline constexpr auto _typed_binary_more = [](auto a, auto b) { return a > b; };
+inline constexpr auto _typed_binary_less = [](auto a, auto b) { return a < b; };
+inline constexpr auto _typed_binary_equal = [](auto a, auto b) { return a == b; };
+
+template <typename T, typename OP>
+static inline t_register_value _binary_op(const t_register_value operand0, const t_register_value operand1, OP op) {
+    return bit_util::bit_cast<T, t_register_value>(op(bit_util::bit_cast<t_register_value, T>(operand0), bit_util::bit_cast<t_register_value, T>(operand1))); 
+}
+
+// Immediates are signed integers converted to the operation's type by value, not by binary.
+template <typename T>
+static inline t_register_value _immediate_as(const int16_t immediate) {
+    return bit_util::bit_cast<T, t_register_value>(static_cast<T>(immediate));
+}
+
+template <typename T, typename OP>
+static inline t_register_value _unary_op(const t_register_value operand0, OP op) {
+    return bit_util::bit_cast<T, t_register_value>(op(bit_util::bit_cast<t_register_value, T>(operand0))); 
+}
+
+template <typename FUNC>
+static inline t_register_value _typed_binary(const value_type type, const t_register_value operand0, const t_register_value operand1, FUNC func) {
+    switch (type) {
+        case VAL_U8:  return _binary_op<uint8_t>(operand0, operand1, func);
+        case VAL_U16: return _binary_op<uint16_t>(operand0, operand1, func);
+        case VAL_U32: return _binary_op<uint32_t>(operand0, operand1, func);
+        case VAL_U64: return _binary_op<uint64_t>(operand0, operand1, func);
+        case VAL_I8:  return _binary_op<int8_t>(operand0, operand1, func);
+        case VAL_I16: return _binary_op<int16_t>(operand0, operand1, func);
+        case VAL_I32: return _binary_op<int32_t>(operand0, operand1, func);
+        case VAL_I64: return _binary_op<int64_t>(operand0, operand1, func);
+        case VAL_F32: return _binary_op<float>(operand0, operand1, func);
+        case VAL_F64: return _binary_op<double>(operand0, operand1, func);
+        default:      return 0;
+    }
+}
+
+template <typename FUNC>
+static inline t_register_value _typed_binary_imm(const value_type type, const t_register_value operand0, const int16_t immediate, FUNC func) {
+    switch (type) {
+        case VAL_U8:  return _binary_op<uint8_t>(operand0, _immediate_as<uint8_t>(immediate), func);
+        case VAL_U16: return _binary_op<uint16_t>(operand0, _immediate_as<uint16_t>(immediate), func);
+        case VAL_U32: return _binary_op<uint32_t>(operand0, _immediate_as<uint32_t>(immediate), func);
+        case VAL_U64: return _binary_op<uint64_t>(operand0, _immediate_as<uint64_t>(immediate), func);
+        case VAL_I8:  return _binary_op<int8_t>(operand0, _immediate_as<int8_t>(immediate), func);
+        case VAL_I16: return _binary_op<int16_t>(operand0, _immediate_as<int16_t>(immediate), func);
+        case VAL_I32: return _binary_op<int32_t>(operand0, _immediate_as<int32_t>(immediate), func);
+        case VAL_I64: return _binary_op<int64_t>(operand0, _immediate_as<int64_t>(immediate), func);
+        case VAL_F32: return _binary_op<float>(operand0, _immediate_as<float>(immediate), func);
+        case VAL_F64: return _binary_op<double>(operand0, _immediate_as<double>(immediate), func);
+        default:      return 0;
+    }
+}
+
+static inline bool _is_numeric(const uint64_t type) {
+    return type >= VAL_U8 && type <= VAL_F64;
+}
+
+template <typename T>
+static inline bool _is_safe_division(const t_register_value operand0, const t_register_value operand1) {
+    if constexpr (std::is_floating_point_v<T>)
+        return true;
+    else {
+        const T dividend = bit_util::bit_cast<t_register_value, T>(operand0);
+        const T divisor = bit_util::bit_cast<t_register_value, T>(operand1);
+
+        if constexpr (std::is_signed_v<T>)
+            return divisor != 0 && !(dividend == std::numeric_limits<T>::min() && divisor == -1);
+        else
+            return divisor != 0;
+    }
+}
+
+// Integer division by zero, and of the smallest signed value by -1, fault in the host.
+// The interpreter traps on them, livm-opt leaves them for the runtime.
+static inline bool _is_safe_division(const uint64_t type, const t_register_value operand0, const t_register_value operand1) {
+    switch (type) {
+        case VAL_U8:  return _is_safe_division<uint8_t>(operand0, operand1);
+        case VAL_U16: return _is_safe_division<uint16_t>(operand0, operand1);
+        case VAL_U32: return _is_safe_division<uint32_t>(operand0, operand1);
+        case VAL_U64: return _is_safe_division<uint64_t>(operand0, operand1);
+        case VAL_I8:  return _is_safe_division<int8_t>(operand0, operand1);
+        case VAL_I16: return _is_safe_division<int16_t>(operand0, operand1);
+        case VAL_I32: return _is_safe_division<int32_t>(operand0, operand1);
+        case VAL_I64: return _is_safe_division<int64_t>(operand0, operand1);
+        case VAL_F32: return true;
+        case VAL_F64: return true;
+        default:      return false;
+    }
+}
+
+static inline t_register_value _typed_immediate(const uint64_t type, const int16_t immediate) {
+    switch (type) {
+        case VAL_U8:  return _immediate_as<uint8_t>(immediate);
+        case VAL_U16: return _immediate_as<uint16_t>(immediate);
+        case VAL_U32: return _immediate_as<uint32_t>(immediate);
+        case VAL_U64: return _immediate_as<uint64_t>(immediate);
+        case VAL_I8:  return _immediate_as<int8_t>(immediate);
+        case VAL_I16: return _immediate_as<int16_t>(immediate);
+        case VAL_I32: return _immediate_as<int32_t>(immediate);
+        case VAL_I64: return _immediate_as<int64_t>(immediate);
+        case VAL_F32: return _immediate_as<float>(immediate);
+        case VAL_F64: return _immediate_as<double>(immediate);
+        default:      return 0;
+    }
+}
@@ -3,6 +3,8 @@
 #include <cstdint>
 #include <utility>
 #include <string>
+#include <cstring>
+#include <algorithm>
 
 template <typename T>
 inline void do_not_optimize_away(T&& value) {
@@ -58,7 +60,7 @@ namespace bit_util {
     template <typename FROM, typename CAST_TO>
     // Unsafe function - sizes of both types are not checked.
     inline CAST_TO bit_cast(FROM from) {
-        CAST_TO to;
+        CAST_TO to{};
         memcpy(&to, &from, std::min(sizeof(from), sizeof(to)));
         return to;
     }
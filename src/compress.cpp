@@ -0,0 +1,413 @@
+#include <fstream>
+#include <condition_variable>
+#include <deque>
+#include <cstring>
+
+#include "compress.hpp"
+
+constexpr uint32_t LZ_MIN_MATCH = 4;
+constexpr uint32_t LZ_WINDOW = UINT16_MAX;
+constexpr uint32_t LZ_HASH_BITS = 16;
+
+// Most bytes one byte of LZ data can decode to, reached by a long match where every length byte adds 255.
+constexpr uint64_t LZ_MAX_EXPANSION = 255;
+
+constexpr uint32_t BLOCK_STORED = 0x80000000;
+constexpr size_t COMPRESSED_HEADER_SIZE = sizeof(COMPRESSED_MAGIC) + 1 + 4 + 4 + 4;
+
+struct _compressed_header {
+    uint32_t chunk_size;
+    uint32_t block_size;
+    uint32_t block_count;
+
+    inline size_t block_start(const uint32_t block) const {
+        return static_cast<size_t>(block) * block_size;
+    }
+
+    inline size_t block_length(const uint32_t block) const {
+        return std::min<size_t>(block_size, chunk_size - block_start(block));
+    }
+};
+
+static inline uint32_t _read_32(const uint8_t* data) {
+    uint32_t value;
+    memcpy(&value, data, sizeof(value));
+    return value;
+}
+
+static inline void _append_32(t_chunk& out, const uint32_t value) {
+    uint8_t b0, b1, b2, b3;
+    bit_util::splitl_32(value, b0, b1, b2, b3);
+    out.insert(out.end(), { b0, b1, b2, b3 });
+}
+
+static inline uint32_t _lz_hash(const uint32_t sequence) {
+    return (sequence * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+static inline void _write_length(t_chunk& out, uint32_t length) {
+    for (; length >= 255; length -= 255)
+        out.emplace_back(255);
+
+    out.emplace_back(length);
+}
+
+// A match length of 0 ends the block after the literals.
+static void _write_sequence(t_chunk& out, const uint8_t* literals, const uint32_t literal_count, const uint32_t offset, const uint32_t match_length) {
+    const uint32_t match_code = match_length > 0 ? match_length - LZ_MIN_MATCH : 0;
+
+    out.emplace_back((std::min(literal_count, 15u) << 4) | std::min(match_code, 15u));
+
+    if (literal_count >= 15)
+        _write_length(out, literal_count - 15);
+
+    out.insert(out.end(), literals, literals + literal_count);
+
+    if (match_length == 0)
+        return;
+
+    out.emplace_back(offset & 0xFF);
+    out.emplace_back(offset >> 8);
+
+    if (match_code >= 15)
+        _write_length(out, match_code - 15);
+}
+
+// Greedy parse with one candidate per hash slot. 'table' holds positions in 'data' and carries over between blocks,
+// so matches can reach back into earlier blocks.
+static void _lz_compress_block(const t_chunk& data, const size_t start, const size_t end, std::vector<int64_t>& table, t_chunk& out) {
+    size_t anchor = start;
+    size_t pos = start;
+
+    while (pos + LZ_MIN_MATCH <= end) {
+        const uint32_t sequence = _read_32(&data[pos]);
+        int64_t& slot = table[_lz_hash(sequence)];
+        const int64_t candidate = slot;
+        slot = pos;
+
+        if (candidate < 0 || pos - candidate > LZ_WINDOW || _read_32(&data[candidate]) != sequence) {
+            pos++;
+            continue;
+        }
+
+        size_t length = LZ_MIN_MATCH;
+
+        while (pos + length < end && data[candidate + length] == data[pos + length])
+            length++;
+
+        _write_sequence(out, &data[anchor], pos - anchor, pos - candidate, length);
+
+        pos += length;
+        anchor = pos;
+    }
+
+    _write_sequence(out, &data[anchor], end - anchor, 0, 0);
+}
+
+// Decodes one LZ block into chunk[pos, pos + size). Returns false if the block is malformed.
+static bool _lz_decompress_block(const uint8_t* src, const size_t src_size, t_chunk& chunk, const size_t pos, const size_t size) {
+    const uint8_t* const src_end = src + src_size;
+    uint8_t* out = chunk.data() + pos;
+    uint8_t* const out_end = out + size;
+
+    const auto read_length = [&](uint32_t& length) {
+        uint8_t byte;
+
+        do {
+            if (src == src_end)
+                return false;
+
+            byte = *src++;
+            length += byte;
+        } while (byte == 255);
+
+        return true;
+    };
+
+    while (src < src_end) {
+        const uint8_t token = *src++;
+        uint32_t literal_count = token >> 4;
+
+        if (literal_count == 15 && !read_length(literal_count))
+            return false;
+
+        if (literal_count > src_end - src || literal_count > out_end - out)
+            return false;
+
+        memcpy(out, src, literal_count);
+        src += literal_count;
+        out += literal_count;
+
+        if (src == src_end)
+            break;
+
+        if (src_end - src < 2)
+            return false;
+
+        const uint32_t offset = src[0] | (src[1] << 8);
+        uint32_t match_length = token & 15;
+        src += 2;
+
+        if (match_length == 15 && !read_length(match_length))
+            return false;
+
+        match_length += LZ_MIN_MATCH;
+
+        if (offset == 0 || offset > out - chunk.data() || match_length > out_end - out)
+            return false;
+
+        // Overlapping matches repeat the last 'offset' bytes, so those are copied forward one byte at a time.
+        const uint8_t* from = out - offset;
+
+        if (offset >= match_length)
+            memcpy(out, from, match_length);
+        else {
+            for (uint32_t i = 0; i < match_length; i++)
+                out[i] = from[i];
+        }
+
+        out += match_length;
+    }
+
+    return out == out_end;
+}
+
+static _compressed_header _parse_header(const uint8_t* data) {
+    if (!std::equal(data, data + sizeof(COMPRESSED_MAGIC), COMPRESSED_MAGIC))
+        throw vm_trap("Not a compressed chunk.");
+
+    if (data[sizeof(COMPRESSED_MAGIC)] != CODEC_LZ)
+        throw vm_trap("Compressed chunk uses an unknown codec.");
+
+    _compressed_header header;
+    header.chunk_size = _read_32(data + sizeof(COMPRESSED_MAGIC) + 1);
+    header.block_size = _read_32(data + sizeof(COMPRESSED_MAGIC) + 5);
+    header.block_count = _read_32(data + sizeof(COMPRESSED_MAGIC) + 9);
+
+    if (header.block_size == 0 || header.block_size > COMPRESSED_BLOCK_MAX
+        || header.block_count != (static_cast<uint64_t>(header.chunk_size) + header.block_size - 1) / header.block_size)
+        throw vm_trap("Compressed chunk has a malformed header.");
+
+    return header;
+}
+
+// Rejects headers whose chunk size can't come out of 'available' bytes of blocks, before the chunk is allocated.
+static void _check_available(const _compressed_header& header, const uint64_t available) {
+    const uint64_t size_fields = static_cast<uint64_t>(header.block_count) * 4;
+
+    if (available < size_fields || header.chunk_size > (available - size_fields) * LZ_MAX_EXPANSION)
+        throw vm_trap("Compressed chunk is truncated.");
+}
+
+static void _decode_block(const _compressed_header& header, const uint32_t block, const uint32_t stored_size, const uint8_t* data, t_chunk& chunk) {
+    const size_t start = header.block_start(block);
+    const size_t length = header.block_length(block);
+    const size_t size = stored_size & ~BLOCK_STORED;
+
+    if (stored_size & BLOCK_STORED) {
+        if (size != length)
+            throw vm_trap("Compressed chunk block " + std::to_string(block) + " has the wrong size.");
+
+        memcpy(chunk.data() + start, data, size);
+    }
+    else if (!_lz_decompress_block(data, size, chunk, start, length))
+        throw vm_trap("Compressed chunk block " + std::to_string(block) + " is corrupt.");
+}
+
+bool is_compressed_chunk(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(COMPRESSED_MAGIC)];
+
+    return file.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), COMPRESSED_MAGIC);
+}
+
+t_chunk compress_chunk(const t_chunk& chunk, const uint32_t block_size) {
+    const uint32_t block_count = (static_cast<uint64_t>(chunk.size()) + block_size - 1) / block_size;
+
+    t_chunk out(COMPRESSED_MAGIC, COMPRESSED_MAGIC + sizeof(COMPRESSED_MAGIC));
+    out.emplace_back(CODEC_LZ);
+    _append_32(out, chunk.size());
+    _append_32(out, block_size);
+    _append_32(out, block_count);
+
+    std::vector<int64_t> table(size_t(1) << LZ_HASH_BITS, -1);
+    t_chunk block;
+
+    for (uint32_t i = 0; i < block_count; i++) {
+        const size_t start = static_cast<size_t>(i) * block_size;
+        const size_t end = std::min<size_t>(start + block_size, chunk.size());
+
+        block.clear();
+        _lz_compress_block(chunk, start, end, table, block);
+
+        // Blocks that don't shrink are stored as they are, so a block never costs more than its size plus 4 bytes.
+        if (block.size() >= end - start) {
+            _append_32(out, (end - start) | BLOCK_STORED);
+            out.insert(out.end(), chunk.begin() + start, chunk.begin() + end);
+        }
+        else {
+            _append_32(out, block.size());
+            out.insert(out.end(), block.begin(), block.end());
+        }
+    }
+
+    return out;
+}
+
+t_chunk decompress_chunk(const t_chunk& data) {
+    if (data.size() < COMPRESSED_HEADER_SIZE)
+        throw vm_trap("Compressed chunk has a truncated header.");
+
+    const _compressed_header header = _parse_header(data.data());
+    _check_available(header, data.size() - COMPRESSED_HEADER_SIZE);
+
+    t_chunk chunk(header.chunk_size);
+    size_t pos = COMPRESSED_HEADER_SIZE;
+
+    for (uint32_t i = 0; i < header.block_count; i++) {
+        if (data.size() - pos < 4)
+            throw vm_trap("Compressed chunk is truncated.");
+
+        const uint32_t stored_size = _read_32(&data[pos]);
+        const size_t size = stored_size & ~BLOCK_STORED;
+        pos += 4;
+
+        if (size > header.block_size || data.size() - pos < size)
+            throw vm_trap("Compressed chunk is truncated.");
+
+        _decode_block(header, i, stored_size, &data[pos], chunk);
+        pos += size;
+    }
+
+    return chunk;
+}
+
+// Hands blocks from the reader thread to the decoder. Bounded, so reading never gets more than
+// COMPRESSED_READ_AHEAD blocks ahead of decoding.
+struct _block_queue {
+    struct block {
+        uint32_t stored_size;
+        t_chunk data;
+    };
+
+    // Waits for room. Returns false once the decoder stopped, the reader should stop then too.
+    inline bool push(block&& entry) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [&] { return _blocks.size() < COMPRESSED_READ_AHEAD || _is_closed; });
+
+        if (_is_closed)
+            return false;
+
+        _blocks.emplace_back(std::move(entry));
+        _condition.notify_all();
+
+        return true;
+    }
+
+    // Waits for the next block. Returns false if the reader failed before producing it.
+    inline bool pop(block& entry) {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [&] { return !_blocks.empty() || _is_failed; });
+
+        if (_blocks.empty())
+            return false;
+
+        entry = std::move(_blocks.front());
+        _blocks.pop_front();
+        _condition.notify_all();
+
+        return true;
+    }
+
+    inline void fail() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_failed = true;
+        _condition.notify_all();
+    }
+
+    inline void close() {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_closed = true;
+        _condition.notify_all();
+    }
+private:
+    std::mutex _mutex;
+    std::condition_variable _condition;
+    std::deque<block> _blocks;
+
+    bool _is_failed = false;
+    bool _is_closed = false;
+};
+
+t_chunk read_compressed_chunk(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    uint8_t header_data[COMPRESSED_HEADER_SIZE];
+
+    if (!file.read(reinterpret_cast<char*>(header_data), sizeof(header_data)))
+        throw vm_trap("Compressed chunk has a truncated header.");
+
+    const _compressed_header header = _parse_header(header_data);
+
+    const std::streampos blocks_start = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streampos file_end = file.tellg();
+
+    if (blocks_start < 0 || file_end < blocks_start || !file.seekg(blocks_start))
+        throw vm_trap("Compressed chunk can't be read.");
+
+    _check_available(header, static_cast<uint64_t>(file_end - blocks_start));
+
+    t_chunk chunk(header.chunk_size);
+    _block_queue queue;
+
+    std::thread reader([&] {
+        for (uint32_t i = 0; i < header.block_count; i++) {
+            _block_queue::block entry;
+            uint8_t size_data[4];
+
+            if (!file.read(reinterpret_cast<char*>(size_data), sizeof(size_data))) {
+                queue.fail();
+                return;
+            }
+
+            entry.stored_size = _read_32(size_data);
+            const size_t size = entry.stored_size & ~BLOCK_STORED;
+
+            if (size > header.block_size) {
+                queue.fail();
+                return;
+            }
+
+            entry.data.resize(size);
+
+            if (!file.read(reinterpret_cast<char*>(entry.data.data()), size)) {
+                queue.fail();
+                return;
+            }
+
+            if (!queue.push(std::move(entry)))
+                return;
+        }
+    });
+
+    try {
+        _block_queue::block entry;
+
+        for (uint32_t i = 0; i < header.block_count; i++) {
+            if (!queue.pop(entry))
+                throw vm_trap("Compressed chunk is truncated or corrupt.");
+
+            _decode_block(header, i, entry.stored_size, entry.data.data(), chunk);
+        }
+    }
+    catch (...) {
+        queue.close();
+        reader.join();
+        throw;
+    }
+
+    queue.close();
+    reader.join();
+
+    return chunk;
+}
@@ -1,7 +1,10 @@
 #include <chrono>
+#include <fstream>
 
 #include "core.hpp"
 #include "instructions.hpp"
+#include "parallel.hpp"
+#include "io.hpp"
 
 constexpr bool CHRONO_MODE = false;
 constexpr uint64_t CHRONO_REPEAT = 50;
@@ -14,7 +17,21 @@ void thread_safe_print(const std::string& string) {
     std::cout << string;
 }
 
-run_thread& run_state::spawn_thread(const t_chunk_pos start_pos) {
+parallel_pool& run_state::parallel() {
+    std::call_once(_parallel_pool_once, [&] { _parallel_pool = std::make_shared<parallel_pool>(); });
+    return *_parallel_pool;
+}
+
+io_context& run_state::io() {
+    std::lock_guard<std::mutex> lock(_io_context_mutex);
+
+    if (_io_context == nullptr)
+        _io_context = std::make_shared<io_context>();
+
+    return *_io_context;
+}
+
+run_thread& run_state::spawn_thread(const t_chunk& start_chunk, const t_literal_list& start_literal_list, const t_chunk_pos start_pos) {
     std::lock_guard<std::mutex> lock(_thread_pool_mutex);
 
     if (_thread_pool.size() > THREAD_POOL_MAX)
@@ -22,18 +39,30 @@ run_thread& run_state::spawn_thread(const t_chunk_pos start_pos) {
 
     for (auto& thread : _thread_pool) {
         if (!thread->is_active()) {
-            thread->init(start_pos);
+            thread->init(start_chunk, start_literal_list, start_pos);
+            thread->tls.assign(program->tls_template.begin(), program->tls_template.end());
             return *thread;
         }
     }
 
-    p_run_thread& thread = _thread_pool.emplace_back(std::make_unique<run_thread>(chunk));
-    thread->init(start_pos);
+    p_run_thread& thread = _thread_pool.emplace_back(std::make_unique<run_thread>());
+    thread->init(start_chunk, start_literal_list, start_pos);
+    thread->tls.assign(program->tls_template.begin(), program->tls_template.end());
+
+    if (is_tracing())
+        thread->trace.enable();
+
+    if (is_profiling())
+        thread->profile.enable(chunk);
+
     return *thread;
 }
 
-t_heap_address run_state::malloc(const uint8_t size) {
-    std::lock_guard<std::mutex> lock(_heap_mutex);
+t_heap_address run_state::malloc(const t_register_value size) {
+    if (size > UINT32_MAX)
+        throw vm_trap("Allocation of " + std::to_string(size) + " bytes is larger than the heap can address.");
+
+    std::scoped_lock lock(_heap_mutex, _free_heap_space_set_mutex);
 
     // Locate a potential spot in the heap we can use first.
     for (auto it = _free_heap_space_set.begin(); it != _free_heap_space_set.end(); it++) {
@@ -51,13 +80,20 @@ t_heap_address run_state::malloc(const uint8_t size) {
     }
 
     t_heap_address start_address = _heap.size();
-    _heap.resize(start_address + size);
+
+    // Checked in 64 bits so a huge request can't wrap the 32 bit address space.
+    const uint64_t new_size = static_cast<uint64_t>(start_address) + size;
+
+    if (new_size > UINT32_MAX || (_heap_cap != 0 && new_size > _heap_cap))
+        throw vm_trap("Heap cap exceeded.");
+
+    _heap.resize(new_size);
 
     return start_address;
 }
 
-void run_state::mfree(const t_heap_address address, const uint8_t size) {
-    std::lock_guard<std::mutex> lock(_free_heap_space_set_mutex);
+void run_state::mfree(const t_heap_address address, const t_heap_address size) {
+    std::scoped_lock lock(_heap_mutex, _free_heap_space_set_mutex);
 
     auto [it, inserted] = _free_heap_space_set.emplace(address, size);
 
@@ -82,6 +118,240 @@ void run_state::mfree(const t_heap_address address, const uint8_t size) {
             _free_heap_space_set.emplace(new_addr, new_size);
         }
     }
+
+    // Free space at the very end of the heap is handed back rather than tracked.
+    auto last = std::prev(_free_heap_space_set.end());
+
+    if (last->address + last->size == _heap.size()) {
+        _heap.resize(last->address);
+        _free_heap_space_set.erase(last);
+
+        if (_heap.size() < _heap.capacity() / 4)
+            _heap.shrink_to_fit();
+    }
+}
+
+heap_stats run_state::get_heap_stats() {
+    std::scoped_lock lock(_heap_mutex, _free_heap_space_set_mutex);
+
+    heap_stats stats;
+    stats.heap_size = _heap.size();
+    stats.heap_cap = _heap_cap;
+    stats.free_block_count = _free_heap_space_set.size();
+
+    for (const _heap_selection& selection : _free_heap_space_set) {
+        stats.free_bytes += selection.size;
+        stats.largest_free_block = std::max(stats.largest_free_block, selection.size);
+    }
+
+    stats.live_bytes = stats.heap_size - stats.free_bytes;
+
+    return stats;
+}
+
+void run_state::reset() {
+    std::scoped_lock lock(_thread_pool_mutex, _heap_mutex, _free_heap_space_set_mutex, _region_list_mutex, _static_memory_mutex);
+
+    // Telemetry starts over too, so every lease of a pooled isolate only reports its own run.
+    for (p_run_thread& thread : _thread_pool) {
+        thread->clean_up();
+        thread->set_suspended(false);
+        thread->alloc_stats.clear();
+        thread->trace.clear();
+        thread->profile.clear();
+    }
+
+    {
+        std::lock_guard<std::mutex> profile_lock(_profile_mutex);
+        std::fill(_profile_sites.begin(), _profile_sites.end(), profile_site());
+    }
+
+    _heap.clear();
+    _free_heap_space_set.clear();
+    _region_list.clear();
+
+    std::fill(_static_memory.begin(), _static_memory.end(), 0);
+
+    // Waits for requests still in flight and closes the files.
+    std::lock_guard<std::mutex> io_lock(_io_context_mutex);
+    _io_context.reset();
+}
+
+void run_state::enable_tracing(const std::string& path) {
+    std::lock_guard<std::mutex> lock(_thread_pool_mutex);
+
+    _trace_path = path;
+    _trace_start_ticks = trace_clock();
+    _trace_start_time = std::chrono::steady_clock::now();
+
+    for (p_run_thread& thread : _thread_pool)
+        thread->trace.enable();
+
+    _is_tracing.store(true, std::memory_order_relaxed);
+}
+
+bool run_state::dump_trace() {
+    if (!is_tracing())
+        return false;
+
+    std::lock_guard<std::mutex> dump_lock(_trace_dump_mutex);
+    std::lock_guard<std::mutex> pool_lock(_thread_pool_mutex);
+
+    using namespace str_util;
+
+    // Calibrate the trace clock against the steady clock over the whole session.
+    const double elapsed_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _trace_start_time).count();
+    const double ticks_per_second = elapsed_seconds > 0 ? (trace_clock() - _trace_start_ticks) / elapsed_seconds : 1.0;
+
+    std::string buffer = "LVTR";
+    write_32(buffer, TRACE_VERSION);
+    write_64(buffer, bit_util::bit_cast<double, uint64_t>(ticks_per_second));
+    write_8(buffer, _thread_pool.size());
+
+    std::unique_ptr<trace_record[]> records = std::make_unique<trace_record[]>(TRACE_RING_SIZE);
+
+    for (size_t id = 0; id < _thread_pool.size(); id++) {
+        const uint32_t count = _thread_pool[id]->trace.copy_to(records.get());
+
+        write_8(buffer, id);
+        write_32(buffer, count);
+        buffer.append(reinterpret_cast<const char*>(records.get()), count * sizeof(trace_record));
+    }
+
+    std::ofstream file(_trace_path, std::ios::binary);
+
+    if (!file.is_open()) {
+        thread_safe_print("Failed to open trace file '" + _trace_path + "'.\n");
+        return false;
+    }
+
+    file.write(buffer.c_str(), buffer.length());
+    return true;
+}
+
+void run_state::enable_profiling(const std::string& path) {
+    std::scoped_lock lock(_thread_pool_mutex, _profile_mutex);
+
+    _profile_path = path;
+    _profile_sites.assign(chunk.size(), profile_site());
+
+    for (p_run_thread& thread : _thread_pool)
+        thread->profile.enable(chunk);
+
+    _is_profiling.store(true, std::memory_order_relaxed);
+}
+
+void run_state::add_profile(const profile_counters& counters) {
+    std::lock_guard<std::mutex> lock(_profile_mutex);
+    counters.add_to(_profile_sites);
+}
+
+bool run_state::dump_profile() {
+    if (!is_profiling())
+        return false;
+
+    std::scoped_lock lock(_thread_pool_mutex, _profile_mutex);
+
+    using namespace str_util;
+
+    std::vector<profile_site> sites = _profile_sites;
+
+    for (p_run_thread& thread : _thread_pool)
+        thread->profile.add_to(sites);
+
+    std::string body;
+    uint32_t site_count = 0;
+
+    for (size_t position = 0; position < sites.size(); position++) {
+        if (sites[position].executed == 0)
+            continue;
+
+        write_32(body, position);
+        write_64(body, sites[position].executed);
+        write_64(body, sites[position].taken);
+        site_count++;
+    }
+
+    std::string buffer(PROFILE_MAGIC, sizeof(PROFILE_MAGIC));
+    write_32(buffer, PROFILE_VERSION);
+    write_32(buffer, chunk.size());
+    write_64(buffer, profile_chunk_hash(chunk));
+    write_32(buffer, site_count);
+    buffer += body;
+
+    std::ofstream file(_profile_path, std::ios::binary);
+
+    if (!file.is_open()) {
+        thread_safe_print("Failed to open profile file '" + _profile_path + "'.\n");
+        return false;
+    }
+
+    file.write(buffer.c_str(), buffer.length());
+    return true;
+}
+
+t_region_id run_state::region_new(const t_register_value capacity) {
+    // malloc traps on capacities past 32 bits, so the narrowing below is exact.
+    const t_heap_address base = malloc(capacity);
+
+    std::lock_guard<std::mutex> lock(_region_list_mutex);
+
+    // Recycle the slot of a freed region if there is one.
+    for (t_region_id id = 0; id < _region_list.size(); id++) {
+        if (!_region_list[id].is_active) {
+            _region_list[id] = _heap_region(base, capacity);
+            return id;
+        }
+    }
+
+    _region_list.emplace_back(base, capacity);
+    return _region_list.size() - 1;
+}
+
+run_state::_heap_region& run_state::_active_region(const t_register_value region) {
+    if (region >= _region_list.size() || !_region_list[region].is_active)
+        throw vm_trap("Region " + std::to_string(region) + " does not exist or was freed.");
+
+    return _region_list[region];
+}
+
+t_heap_address run_state::region_alloc(const t_register_value region, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_region_list_mutex);
+
+    _heap_region& target = _active_region(region);
+
+    if (target.capacity - target.used < size)
+        throw vm_trap("Region capacity exceeded.");
+
+    const t_heap_address address = target.base + target.used;
+    target.used += size;
+
+    return address;
+}
+
+void run_state::region_reset(const t_register_value region) {
+    std::lock_guard<std::mutex> lock(_region_list_mutex);
+
+    _active_region(region).used = 0;
+}
+
+t_heap_address run_state::region_free(const t_register_value region) {
+    t_heap_address base, capacity;
+
+    {
+        std::lock_guard<std::mutex> lock(_region_list_mutex);
+
+        _heap_region& target = _active_region(region);
+        target.is_active = false;
+
+        base = target.base;
+        capacity = target.capacity;
+    }
+
+    // The whole region goes back as a single free block.
+    mfree(base, capacity);
+
+    return capacity;
 }
 
 void run_state::mwrite(const t_heap_address address, const t_register_value value, const uint8_t bytes) {
@@ -104,6 +374,91 @@ t_register_value run_state::mread(const t_heap_address address, const uint8_t si
     return value;
 }
 
+void run_state::_check_heap_range(const t_register_value address, const t_register_value size) const {
+    if (address > _heap.size() || size > _heap.size() - address)
+        throw vm_trap("Heap range of " + std::to_string(size) + " bytes at " + std::to_string(address) + " is out of bounds.");
+}
+
+void run_state::_check_static_range(const t_register_value address, const t_register_value size) const {
+    if (address > _static_memory.size() || size > _static_memory.size() - address)
+        throw vm_trap("Static memory range of " + std::to_string(size) + " bytes at " + std::to_string(address) + " is out of bounds.");
+}
+
+void run_state::mcopy(const t_register_value dest, const t_register_value source, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(dest, size);
+    _check_heap_range(source, size);
+
+    // Both ranges are inside the heap, so the sums can't overflow.
+    if (size > 0 && dest < source + size && source < dest + size)
+        throw vm_trap("Heap copy of " + std::to_string(size) + " bytes from " + std::to_string(source) + " to " + std::to_string(dest) + " overlaps, use OP_MMOVE.");
+
+    memcpy(_heap.data() + dest, _heap.data() + source, size);
+}
+
+void run_state::mmove(const t_register_value dest, const t_register_value source, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(dest, size);
+    _check_heap_range(source, size);
+
+    memmove(_heap.data() + dest, _heap.data() + source, size);
+}
+
+void run_state::mset(const t_register_value dest, const uint8_t value, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(dest, size);
+
+    memset(_heap.data() + dest, value, size);
+}
+
+int run_state::mcompare(const t_register_value address0, const t_register_value address1, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(address0, size);
+    _check_heap_range(address1, size);
+
+    const int result = memcmp(_heap.data() + address0, _heap.data() + address1, size);
+
+    return (result > 0) - (result < 0);
+}
+
+void run_state::mcopy_from_static(const t_register_value dest, const t_register_value source, const t_register_value size) {
+    std::scoped_lock lock(_heap_mutex, _static_memory_mutex);
+
+    _check_heap_range(dest, size);
+    _check_static_range(source, size);
+
+    memcpy(_heap.data() + dest, _static_memory.data() + source, size);
+}
+
+void run_state::mcopy_to_static(const t_register_value dest, const t_register_value source, const t_register_value size) {
+    std::scoped_lock lock(_heap_mutex, _static_memory_mutex);
+
+    _check_static_range(dest, size);
+    _check_heap_range(source, size);
+
+    memcpy(_static_memory.data() + dest, _heap.data() + source, size);
+}
+
+void run_state::mread_bytes(uint8_t* dest, const t_register_value source, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(source, size);
+
+    memcpy(dest, _heap.data() + source, size);
+}
+
+void run_state::mwrite_bytes(const t_register_value dest, const uint8_t* source, const t_register_value size) {
+    std::lock_guard<std::mutex> lock(_heap_mutex);
+
+    _check_heap_range(dest, size);
+
+    memcpy(_heap.data() + dest, source, size);
+}
+
 void run_state::swrite(const t_static_address address, const t_register_value value, const uint8_t bytes) {
     std::lock_guard<std::mutex> lock(_static_memory_mutex);
 
@@ -138,7 +493,8 @@ inline int direct_thread_execution(run_state& state, run_thread& thread) {
     return sink;
 }
 
-void execute_thread(run_state& state, run_thread& thread) {
+// Runs the thread once, or repeatedly with timing in CHRONO_MODE.
+static inline void timed_thread_execution(run_state& state, run_thread& thread) {
     if constexpr (!CHRONO_MODE)
         direct_thread_execution(state, thread);
     else {
@@ -161,6 +517,77 @@ void execute_thread(run_state& state, run_thread& thread) {
 
         thread_safe_print("Avg time (ns): " + std::to_string(diff.count() / (CHRONO_REPEAT - CHRONO_CACHE_FORGIVE)) + '\n');
     }
+}
+
+// Runs time slices until the thread finishes or its run budget is spent. Returns false if the thread was suspended.
+static bool sliced_thread_execution(run_state& state, run_thread& thread) {
+    const run_budget budget = state.budget;
+    const auto run_start = std::chrono::steady_clock::now();
+    const bool has_limit = budget.run_fuel_limit != 0 || budget.run_time_limit.count() != 0;
+    const uint64_t fuel_slice = budget.fuel_slice != 0 ? budget.fuel_slice : has_limit ? DEFAULT_FUEL_SLICE : 0;
+    const int64_t slice = fuel_slice == 0 ? INT64_MAX : static_cast<int64_t>(std::min<uint64_t>(fuel_slice, INT64_MAX));
+
+    uint64_t fuel_spent = 0;
+
+    while (true) {
+        thread.fuel = slice;
+        timed_thread_execution(state, thread);
+        thread.resume_slice();
+
+        if (thread.at_eof() || thread._call_stack.empty())
+            return true;
+
+        // The last charge can overshoot, so the slice counts for what it actually burned.
+        fuel_spent += slice - thread.fuel;
+
+        const bool out_of_fuel = budget.run_fuel_limit != 0 && fuel_spent >= budget.run_fuel_limit;
+        const bool out_of_time = budget.run_time_limit.count() != 0 && std::chrono::steady_clock::now() - run_start >= budget.run_time_limit;
+
+        if (out_of_fuel || out_of_time)
+            return false;
+
+        std::this_thread::yield();
+    }
+}
+
+bool execute_call(run_state& state, run_thread& thread, const t_chunk& chunk, const t_literal_list& literal_list, const t_chunk_pos entry, const t_local_stack& locals, t_register_value& result) {
+    // The bottom frame only receives the result. Returning to the end of the chunk stops the thread right there.
+    thread.init(chunk, literal_list, entry);
+    thread._call_stack.emplace_back(chunk.size(), 1).local_stack = locals;
+
+    bool is_finished;
+
+    try {
+        is_finished = sliced_thread_execution(state, thread);
+    }
+    catch (...) {
+        thread.clean_up();
+        throw;
+    }
+
+    result = thread._call_stack.front().reg_copy_from(0);
+    thread.clean_up();
+
+    return is_finished;
+}
+
+void execute_thread(run_state& state, run_thread& thread) {
+    thread.set_suspended(false);
+
+    try {
+        if (!sliced_thread_execution(state, thread)) {
+            thread.set_suspended(true);
+            return;
+        }
+    }
+    catch (const vm_trap& trap) {
+        thread_safe_print("Trap at ip " + std::to_string(thread.ip) + ": " + trap.what() + '\n');
+
+        if (thread.trace.is_enabled()) {
+            thread.trace.push(thread.ip, thread.now(), TRACE_TRAP, 0, 0);
+            state.dump_trace();
+        }
+    }
 
     thread.clean_up();
 }
\ No newline at end of file
@@ -1,23 +1,11 @@
 #include <utility>
 
 #include "instructions.hpp"
-
-inline constexpr auto _typed_binary_add = [](auto a, auto b) { return a + b; };
-inline constexpr auto _typed_binary_sub = [](auto a, auto b) { return a - b; };
-inline constexpr auto _typed_binary_mul = [](auto a, auto b) { return a * b; };
-inline constexpr auto _typed_binary_div = [](auto a, auto b) { return a / b; };
-inline constexpr auto _typed_binary_more = [](auto a, auto b) { return a > b; };
-inline constexpr auto _typed_binary_less = [](auto a, auto b) { return a < b; };
-
-template <typename T, typename OP>
-static inline t_register_value _binary_op(const t_register_value operand0, const t_register_value operand1, OP op) {
-    return bit_util::bit_cast<T, t_register_value>(op(bit_util::bit_cast<t_register_value, T>(operand0), bit_util::bit_cast<t_register_value, T>(operand1))); 
-}
-
-template <typename T, typename OP>
-static inline t_register_value _unary_op(const t_register_value operand0, OP op) {
-    return bit_util::bit_cast<T, t_register_value>(op(bit_util::bit_cast<t_register_value, T>(operand0))); 
-}
+#include "simd.hpp"
+#include "module.hpp"
+#include "typed_ops.hpp"
+#include "parallel.hpp"
+#include "io.hpp"
 
 void instr_out(run_state& state, run_thread& thread, call_frame& top_frame) {
     const value_type type = static_cast<value_type>(thread.next());
@@ -48,9 +36,9 @@ void instr_out(run_state& state, run_thread& thread, call_frame& top_frame) {
 
 void instr_load(run_state& state, run_thread& thread, call_frame& top_frame) {
     const t_register_id target_reg = thread.next();
-    const t_literal_id literal_to_load = _call_mergel_16(thread.chunk, thread.ip);
+    const t_literal_id literal_to_load = _call_mergel_16(*thread.chunk, thread.ip);
 
-    top_frame.reg_copy_to(target_reg, state.lit_copy_from(literal_to_load));
+    top_frame.reg_copy_to(target_reg, thread.lit_copy_from(literal_to_load));
 }
 
 template <typename FUNC>
@@ -60,22 +48,7 @@ inline void typed_binary_instr(run_thread& thread, call_frame& top_frame, FUNC f
     const t_register_value& operand0 = top_frame.reg_copy_from(thread.next());
     const t_register_value& operand1 = top_frame.reg_copy_from(thread.next());
 
-    uint64_t result;
-
-    switch (type) {
-        case VAL_U8:  result = _binary_op<uint8_t>(operand0, operand1, func); break;
-        case VAL_U16: result = _binary_op<uint16_t>(operand0, operand1, func); break;
-        case VAL_U32: result = _binary_op<uint32_t>(operand0, operand1, func); break;
-        case VAL_U64: result = _binary_op<uint64_t>(operand0, operand1, func); break;
-        case VAL_I8:  result = _binary_op<int8_t>(operand0, operand1, func); break;
-        case VAL_I16: result = _binary_op<int16_t>(operand0, operand1, func); break;
-        case VAL_I32: result = _binary_op<int32_t>(operand0, operand1, func); break;
-        case VAL_I64: result = _binary_op<int64_t>(operand0, operand1, func); break;
-        case VAL_F32: result = _binary_op<float>(operand0, operand1, func); break;
-        case VAL_F64: result = _binary_op<double>(operand0, operand1, func); break;
-    }
-
-    top_frame.reg_copy_to(target_reg, result);
+    top_frame.reg_copy_to(target_reg, _typed_binary(type, operand0, operand1, func));
 }
 
 void instr_binary_add(run_state& state, run_thread& thread, call_frame& top_frame) {
@@ -111,17 +84,24 @@ void instr_binary_equal(run_state& state, run_thread& thread, call_frame& top_fr
 }
 
 void instr_malloc(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
     const t_register_id target_reg = thread.next();
-    const t_register_id size_reg = thread.next();
+    const t_register_value size = top_frame.reg_copy_from(thread.next());
+    const t_heap_address address = state.malloc(size);
 
-    top_frame.reg_copy_to(target_reg, state.malloc(top_frame.reg_copy_from(size_reg)));
+    top_frame.reg_copy_to(target_reg, address);
+    thread.alloc_stats.record_alloc(size);
+    thread.trace_event(instruction_location, TRACE_MALLOC, address, size);
 }
 
 void instr_mfree(run_state& state, run_thread& thread, call_frame& top_frame) {
-    const t_register_id pointer_reg = thread.next();
-    const t_register_id size_reg = thread.next();
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const t_heap_address address = top_frame.reg_copy_from(thread.next());
+    const t_heap_address size = top_frame.reg_copy_from(thread.next());
 
-    state.mfree(top_frame.reg_copy_from(pointer_reg), top_frame.reg_copy_from(size_reg));
+    state.mfree(address, size);
+    thread.alloc_stats.record_free(size);
+    thread.trace_event(instruction_location, TRACE_MFREE, address, size);
 }
 
 void instr_mwrite(run_state& state, run_thread& thread, call_frame& top_frame) {
@@ -147,13 +127,13 @@ void instr_loc_push(run_state& state, run_thread& thread, call_frame& top_frame)
 
 void instr_loc_copy(run_state& state, run_thread& thread, call_frame& top_frame) {
     const t_register_id target_reg = thread.next();
-    const t_local_id local_index = _call_mergel_16(thread.chunk, thread.ip);
+    const t_local_id local_index = _call_mergel_16(*thread.chunk, thread.ip);
     top_frame.reg_copy_to(target_reg, top_frame.local_stack[local_index]);
 }
 
 void instr_call(run_state& state, run_thread& thread, call_frame& top_frame) {
     const t_chunk_pos instruction_location = thread.ip - 1;
-    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(thread.chunk, thread.ip));
+    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(*thread.chunk, thread.ip));
     const t_register_id return_value_reg = thread.next();
     const uint8_t argument_count = thread.next();
 
@@ -165,48 +145,126 @@ void instr_call(run_state& state, run_thread& thread, call_frame& top_frame) {
 
     thread._call_stack.emplace_back(new_stack_frame);
 
-    thread.ip += instruction_location + jump_distance;
+    thread.ip = instruction_location + jump_distance;
+    thread.trace_event(instruction_location, TRACE_CALL, thread.ip, return_value_reg);
+    thread.profile_event(instruction_location, 1);
+    thread.burn_fuel(FUEL_CALL_COST);
 }
 
 void instr_desync(run_state& state, run_thread& thread, call_frame& top_frame) {
     const t_chunk_pos instruction_location = thread.ip - 1;
-    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(thread.chunk, thread.ip));
+    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(*thread.chunk, thread.ip));
     const uint8_t argument_count = thread.next();
 
-    run_thread& new_thread = state.spawn_thread(instruction_location + jump_distance);
+    // The target is in the chunk this instruction is in, which is a module function body when running a module.
+    run_thread& new_thread = state.spawn_thread(*thread.chunk, *thread.literal_list, instruction_location + jump_distance);
 
     for (int i = 0; i < argument_count; i++) {
         new_thread.top_frame().local_stack.emplace_back(top_frame.reg_copy_from(thread.next()));
     }
     
+    thread.trace_event(instruction_location, TRACE_DESYNC, instruction_location + jump_distance, argument_count);
+    thread.profile_event(instruction_location, 1);
+
     std::thread detached_thread(execute_thread, std::ref(state), std::ref(new_thread));
     detached_thread.detach();
+
+    thread.burn_fuel(FUEL_CALL_COST);
+}
+
+void instr_tail_call(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(*thread.chunk, thread.ip));
+    const uint8_t argument_count = thread.next();
+
+    // Arguments come from registers, which rebinding the locals doesn't touch, so the frame can be rewritten in place.
+    top_frame.local_stack.clear();
+
+    for (int i = 0; i < argument_count; i++) {
+        top_frame.local_stack.emplace_back(top_frame.reg_copy_from(thread.next()));
+    }
+
+    thread.ip = instruction_location + jump_distance;
+    thread.trace_event(instruction_location, TRACE_TAIL_CALL, thread.ip, top_frame.return_value_reg);
+    thread.profile_event(instruction_location, 1);
+    thread.burn_fuel(FUEL_CALL_COST);
 }
 
 void instr_return(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+
     // Write return value.
     if (top_frame.return_value_reg > 0) {
         thread._call_stack[thread._call_stack.size() - 2].reg_copy_to(top_frame.return_value_reg - 1, top_frame.reg_copy_from(thread.next()));
     }  
 
+    thread.trace_event(instruction_location, TRACE_RETURN, top_frame.return_address);
+
+    if (top_frame.return_chunk) {
+        thread.chunk = top_frame.return_chunk;
+        thread.literal_list = top_frame.return_literal_list;
+    }
+
     thread.ip = top_frame.return_address;
     thread._call_stack.pop_back();
 }
 
+// Jumps back to or before themselves close loops, so they are charged the length of the loop body.
+// A jump to itself still pays 1, otherwise it could spin forever on a full slice.
+static inline void _charge_jump(run_thread& thread, const t_chunk_pos instruction_location) {
+    if (thread.ip <= instruction_location)
+        thread.burn_fuel(std::max<int64_t>(static_cast<int64_t>(instruction_location) - thread.ip, 1));
+}
+
 void instr_jump_i8(run_state& state, run_thread& thread, call_frame& top_frame) {
-    thread.ip += bit_util::bit_cast<uint8_t, int8_t>(thread.next()) - 2;
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const int8_t jump_length = bit_util::bit_cast<uint8_t, int8_t>(thread.next());
+
+    thread.ip += jump_length - 2;
+    thread.trace_event(instruction_location, TRACE_JUMP, thread.ip);
+    thread.profile_event(instruction_location, 1);
+    _charge_jump(thread, instruction_location);
 }
 
 void instr_jump_i16(run_state& state, run_thread& thread, call_frame& top_frame) {
-    thread.ip += bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(thread.chunk, thread.ip)) - 3;
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const int16_t jump_length = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+
+    thread.ip += jump_length - 3;
+    thread.trace_event(instruction_location, TRACE_JUMP, thread.ip);
+    thread.profile_event(instruction_location, 1);
+    _charge_jump(thread, instruction_location);
 }
 
 void instr_jump_if_false(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
     const t_register_id source_reg = thread.next();
-    const t_register_id jump_length = _call_mergel_16(thread.chunk, thread.ip);
+    const int16_t jump_length = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
 
-    if (top_frame.reg_copy_from(source_reg) == 0ULL)
-        thread.ip += bit_util::bit_cast<uint16_t, int16_t>(jump_length);
+    const bool is_taken = top_frame.reg_copy_from(source_reg) == 0ULL;
+
+    if (is_taken) {
+        thread.ip += jump_length;
+        thread.trace_event(instruction_location, TRACE_JUMP, thread.ip);
+        _charge_jump(thread, instruction_location);
+    }
+
+    thread.profile_event(instruction_location, is_taken);
+}
+
+void instr_jump_if_true(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const t_register_id source_reg = thread.next();
+    const int16_t jump_length = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+    const bool is_taken = top_frame.reg_copy_from(source_reg) != 0ULL;
+
+    if (is_taken) {
+        thread.ip += jump_length;
+        thread.trace_event(instruction_location, TRACE_JUMP, thread.ip);
+        _charge_jump(thread, instruction_location);
+    }
+
+    thread.profile_event(instruction_location, is_taken);
 }
 
 void instr_unary_not(run_state& state, run_thread& thread, call_frame& top_frame) {
@@ -225,4 +283,568 @@ void instr_unary_neg(run_state& state, run_thread& thread, call_frame& top_frame
     const t_register_value write_data = top_frame.reg_copy_from(source_reg) ^ (1ULL << 63);
 
     top_frame.reg_copy_to(target_reg, write_data);
-}
\ No newline at end of file
+}
+
+// Bytes taken by 'count' elements of 'type'. Traps on types the vector instructions don't work on.
+static inline t_register_value vector_bytes(const value_type type, const t_register_value count) {
+    const size_t element_size = simd::element_size(type);
+
+    if (element_size == 0)
+        throw vm_trap("Vector instructions don't work on value type " + std::to_string(type) + '.');
+
+    if (count > UINT64_MAX / element_size)
+        throw vm_trap("Vector of " + std::to_string(count) + " elements is too large.");
+
+    return count * element_size;
+}
+
+template <simd::vector_op OP>
+inline void vector_binary_instr(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_value target_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value operand0_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value operand1_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value count = top_frame.reg_copy_from(thread.next());
+    const t_register_value size = vector_bytes(type, count);
+
+    state.heap_view({ { target_address, size }, { operand0_address, size }, { operand1_address, size } }, [&](uint8_t* heap) {
+        simd::binary(type, OP, heap + target_address, heap + operand0_address, heap + operand1_address, count);
+    });
+}
+
+template <simd::reduce_op OP>
+inline void vector_reduce_instr(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_id target_reg = thread.next();
+    const t_register_value source_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value count = top_frame.reg_copy_from(thread.next());
+    const t_register_value size = vector_bytes(type, count);
+
+    const t_register_value result = state.heap_view({ { source_address, size } }, [&](uint8_t* heap) {
+        return simd::reduce(type, OP, heap + source_address, count);
+    });
+
+    top_frame.reg_copy_to(target_reg, result);
+}
+
+void instr_vector_add(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_ADD>(state, thread, top_frame);
+}
+
+void instr_vector_sub(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_SUB>(state, thread, top_frame);
+}
+
+void instr_vector_mul(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_MUL>(state, thread, top_frame);
+}
+
+void instr_vector_div(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_DIV>(state, thread, top_frame);
+}
+
+void instr_vector_min(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_MIN>(state, thread, top_frame);
+}
+
+void instr_vector_max(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_MAX>(state, thread, top_frame);
+}
+
+void instr_vector_more(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_MORE>(state, thread, top_frame);
+}
+
+void instr_vector_less(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_LESS>(state, thread, top_frame);
+}
+
+void instr_vector_equal(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_binary_instr<simd::VEC_EQUAL>(state, thread, top_frame);
+}
+
+void instr_vector_sum(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_reduce_instr<simd::RED_SUM>(state, thread, top_frame);
+}
+
+void instr_vector_rmin(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_reduce_instr<simd::RED_MIN>(state, thread, top_frame);
+}
+
+void instr_vector_rmax(run_state& state, run_thread& thread, call_frame& top_frame) {
+    vector_reduce_instr<simd::RED_MAX>(state, thread, top_frame);
+}
+
+void instr_vector_dot(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_id target_reg = thread.next();
+    const t_register_value operand0_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value operand1_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value count = top_frame.reg_copy_from(thread.next());
+    const t_register_value size = vector_bytes(type, count);
+
+    const t_register_value result = state.heap_view({ { operand0_address, size }, { operand1_address, size } }, [&](uint8_t* heap) {
+        return simd::dot(type, heap + operand0_address, heap + operand1_address, count);
+    });
+
+    top_frame.reg_copy_to(target_reg, result);
+}
+
+void instr_mcopy(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id dest_reg = thread.next();
+    const t_register_id source_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    state.mcopy(top_frame.reg_copy_from(dest_reg), top_frame.reg_copy_from(source_reg), top_frame.reg_copy_from(size_reg));
+}
+
+void instr_mmove(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id dest_reg = thread.next();
+    const t_register_id source_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    state.mmove(top_frame.reg_copy_from(dest_reg), top_frame.reg_copy_from(source_reg), top_frame.reg_copy_from(size_reg));
+}
+
+void instr_mset(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id dest_reg = thread.next();
+    const t_register_id value_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    state.mset(top_frame.reg_copy_from(dest_reg), top_frame.reg_copy_from(value_reg) & 0xFF, top_frame.reg_copy_from(size_reg));
+}
+
+void instr_mcompare(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_id operand0_reg = thread.next();
+    const t_register_id operand1_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    const int64_t result = state.mcompare(top_frame.reg_copy_from(operand0_reg), top_frame.reg_copy_from(operand1_reg), top_frame.reg_copy_from(size_reg));
+
+    top_frame.reg_copy_to(target_reg, bit_util::bit_cast<int64_t, t_register_value>(result));
+}
+
+void instr_mcopy_from_static(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id dest_reg = thread.next();
+    const t_register_id source_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    state.mcopy_from_static(top_frame.reg_copy_from(dest_reg), top_frame.reg_copy_from(source_reg), top_frame.reg_copy_from(size_reg));
+}
+
+void instr_mcopy_to_static(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id dest_reg = thread.next();
+    const t_register_id source_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    state.mcopy_to_static(top_frame.reg_copy_from(dest_reg), top_frame.reg_copy_from(source_reg), top_frame.reg_copy_from(size_reg));
+}
+
+void instr_load_imm8(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    top_frame.reg_copy_to(target_reg, thread.next());
+}
+
+void instr_load_imm16(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    top_frame.reg_copy_to(target_reg, _call_mergel_16(*thread.chunk, thread.ip));
+}
+
+void instr_load_imm32(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    top_frame.reg_copy_to(target_reg, _call_mergel_32(*thread.chunk, thread.ip));
+}
+
+void instr_load_imm64(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    top_frame.reg_copy_to(target_reg, _call_mergel_64(*thread.chunk, thread.ip));
+}
+
+template <typename FUNC>
+inline void typed_binary_imm_instr(run_thread& thread, call_frame& top_frame, FUNC func) {
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_id target_reg = thread.next();
+    const t_register_value operand0 = top_frame.reg_copy_from(thread.next());
+    const int16_t immediate = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+
+    top_frame.reg_copy_to(target_reg, _typed_binary_imm(type, operand0, immediate, func));
+}
+
+// Fused compare and branch. Like OP_JUMP_IF_FALSE, the offset is relative to the end of the instruction.
+template <typename FUNC>
+inline void typed_jump_imm_instr(run_thread& thread, call_frame& top_frame, FUNC func) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_value operand0 = top_frame.reg_copy_from(thread.next());
+    const int16_t immediate = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+    const int16_t jump_length = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+
+    const bool is_taken = _typed_binary_imm(type, operand0, immediate, func) == 0ULL;
+
+    if (is_taken) {
+        thread.ip += jump_length;
+        thread.trace_event(instruction_location, TRACE_JUMP, thread.ip);
+        _charge_jump(thread, instruction_location);
+    }
+
+    thread.profile_event(instruction_location, is_taken);
+}
+
+void instr_binary_add_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_add);
+}
+
+void instr_binary_sub_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_sub);
+}
+
+void instr_binary_mul_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_mul);
+}
+
+void instr_binary_div_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const value_type type = static_cast<value_type>(thread.next());
+    const t_register_id target_reg = thread.next();
+    const t_register_value operand0 = top_frame.reg_copy_from(thread.next());
+    const int16_t immediate = bit_util::bit_cast<uint16_t, int16_t>(_call_mergel_16(*thread.chunk, thread.ip));
+
+    if (_is_numeric(type) && !_is_safe_division(type, operand0, _typed_immediate(type, immediate)))
+        throw vm_trap(immediate == 0 ? "Integer division by zero." : "Integer division overflows.");
+
+    top_frame.reg_copy_to(target_reg, _typed_binary_imm(type, operand0, immediate, _typed_binary_div));
+}
+
+void instr_binary_more_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_more);
+}
+
+void instr_binary_less_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_less);
+}
+
+void instr_binary_equal_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_binary_imm_instr(thread, top_frame, _typed_binary_equal);
+}
+
+void instr_jump_if_not_less_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_jump_imm_instr(thread, top_frame, _typed_binary_less);
+}
+
+void instr_jump_if_not_more_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_jump_imm_instr(thread, top_frame, _typed_binary_more);
+}
+
+void instr_jump_if_not_equal_imm(run_state& state, run_thread& thread, call_frame& top_frame) {
+    typed_jump_imm_instr(thread, top_frame, _typed_binary_equal);
+}
+
+void instr_region_new(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value capacity = top_frame.reg_copy_from(thread.next());
+
+    // Regions show up in the allocation stats as one block, their bump allocations don't.
+    top_frame.reg_copy_to(target_reg, state.region_new(capacity));
+    thread.alloc_stats.record_alloc(capacity);
+}
+
+void instr_region_alloc(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_id region_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    top_frame.reg_copy_to(target_reg, state.region_alloc(top_frame.reg_copy_from(region_reg), top_frame.reg_copy_from(size_reg)));
+}
+
+void instr_region_reset(run_state& state, run_thread& thread, call_frame& top_frame) {
+    state.region_reset(top_frame.reg_copy_from(thread.next()));
+}
+
+void instr_region_free(run_state& state, run_thread& thread, call_frame& top_frame) {
+    thread.alloc_stats.record_free(state.region_free(top_frame.reg_copy_from(thread.next())));
+}
+
+void instr_heap_stat(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const uint8_t stat = thread.next();
+
+    const thread_alloc_stats& thread_stats = thread.alloc_stats;
+    t_register_value result = 0;
+
+    switch (stat) {
+        case STAT_THREAD_ALLOC_COUNT: result = thread_stats.alloc_count.load(std::memory_order_relaxed); break;
+        case STAT_THREAD_FREE_COUNT:  result = thread_stats.free_count.load(std::memory_order_relaxed); break;
+        case STAT_THREAD_ALLOC_BYTES: result = thread_stats.alloc_bytes.load(std::memory_order_relaxed); break;
+        case STAT_THREAD_FREE_BYTES:  result = thread_stats.free_bytes.load(std::memory_order_relaxed); break;
+        default:
+            if (stat >= STAT_THREAD_HISTOGRAM) {
+                if (stat - STAT_THREAD_HISTOGRAM < ALLOC_HISTOGRAM_BUCKETS)
+                    result = thread_stats.size_histogram[stat - STAT_THREAD_HISTOGRAM].load(std::memory_order_relaxed);
+
+                break;
+            }
+
+            // Only the shared heap stats need the heap walk.
+            const heap_stats stats = state.get_heap_stats();
+
+            switch (stat) {
+                case STAT_HEAP_SIZE:          result = stats.heap_size; break;
+                case STAT_LIVE_BYTES:         result = stats.live_bytes; break;
+                case STAT_FREE_BYTES:         result = stats.free_bytes; break;
+                case STAT_LARGEST_FREE_BLOCK: result = stats.largest_free_block; break;
+                case STAT_FREE_BLOCK_COUNT:   result = stats.free_block_count; break;
+                case STAT_HEAP_CAP:           result = stats.heap_cap; break;
+            }
+            break;
+    }
+
+    top_frame.reg_copy_to(target_reg, result);
+}
+void instr_call_fn(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const t_function_id function_id = _call_mergel_16(*thread.chunk, thread.ip);
+    const t_register_id return_value_reg = thread.next();
+    const uint8_t argument_count = thread.next();
+
+    if (!state.modules)
+        throw vm_trap("OP_CALL_FN needs a module, this program is a plain chunk.");
+
+    const t_chunk& body = state.modules->body(function_id);
+
+    auto new_stack_frame = call_frame(thread.ip + argument_count, return_value_reg, thread.chunk, thread.literal_list);
+
+    for (int i = 0; i < argument_count; i++) {
+        new_stack_frame.local_stack.emplace_back(top_frame.reg_copy_from(thread.next()));
+    }
+
+    thread._call_stack.emplace_back(new_stack_frame);
+
+    // Recorded before switching chunks, the record reads the opcode at instruction_location.
+    thread.trace_event(instruction_location, TRACE_CALL, 0, return_value_reg);
+
+    thread.chunk = &body;
+    thread.literal_list = &state.modules->literal_list(function_id);
+    thread.ip = 0;
+    thread.burn_fuel(FUEL_CALL_COST);
+}
+
+void instr_desync_fn(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const t_function_id function_id = _call_mergel_16(*thread.chunk, thread.ip);
+    const uint8_t argument_count = thread.next();
+
+    if (!state.modules)
+        throw vm_trap("OP_DESYNC_FN needs a module, this program is a plain chunk.");
+
+    const t_chunk& body = state.modules->body(function_id);
+
+    run_thread& new_thread = state.spawn_thread(body, state.modules->literal_list(function_id), 0);
+
+    for (int i = 0; i < argument_count; i++) {
+        new_thread.top_frame().local_stack.emplace_back(top_frame.reg_copy_from(thread.next()));
+    }
+
+    thread.trace_event(instruction_location, TRACE_DESYNC, 0, argument_count);
+
+    std::thread detached_thread(execute_thread, std::ref(state), std::ref(new_thread));
+    detached_thread.detach();
+
+    thread.burn_fuel(FUEL_CALL_COST);
+}
+
+void instr_tread(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id pointer_reg = thread.next();
+    const t_register_id target_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    const t_register_value tls_value = thread.tread(top_frame.reg_copy_from(pointer_reg), top_frame.reg_copy_from(size_reg));
+    top_frame.reg_copy_to(target_reg, tls_value);
+}
+
+void instr_twrite(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id pointer_reg = thread.next();
+    const t_register_id source_reg = thread.next();
+    const t_register_id size_reg = thread.next();
+
+    thread.twrite(top_frame.reg_copy_from(pointer_reg), top_frame.reg_copy_from(source_reg), top_frame.reg_copy_from(size_reg));
+}
+
+static t_register_value _reduce(const reduction op, const value_type type, const t_register_value a, const t_register_value b) {
+    switch (op) {
+        case REDUCTION_ADD: return _typed_binary(type, a, b, _typed_binary_add);
+        case REDUCTION_MUL: return _typed_binary(type, a, b, _typed_binary_mul);
+        case REDUCTION_MIN: return _typed_binary(type, b, a, _typed_binary_less) ? b : a;
+        case REDUCTION_MAX: return _typed_binary(type, b, a, _typed_binary_more) ? b : a;
+        default:         throw vm_trap("Unknown reduction " + std::to_string(op) + '.');
+    }
+}
+
+void instr_parallel_for(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_chunk_pos instruction_location = thread.ip - 1;
+    const int32_t jump_distance = bit_util::bit_cast<uint32_t, int32_t>(_call_mergel_32(*thread.chunk, thread.ip));
+    const int64_t begin = bit_util::bit_cast<t_register_value, int64_t>(top_frame.reg_copy_from(thread.next()));
+    const int64_t end = bit_util::bit_cast<t_register_value, int64_t>(top_frame.reg_copy_from(thread.next()));
+    const t_register_value grain = top_frame.reg_copy_from(thread.next());
+    const t_register_id result_reg = thread.next();
+    const value_type type = static_cast<value_type>(thread.next());
+    const reduction reduce = static_cast<reduction>(thread.next());
+    const uint8_t argument_count = thread.next();
+
+    t_local_stack locals(1);
+
+    for (int i = 0; i < argument_count; i++) {
+        locals.emplace_back(top_frame.reg_copy_from(thread.next()));
+    }
+
+    const t_chunk& chunk = *thread.chunk;
+    const t_literal_list& literal_list = *thread.literal_list;
+    const t_chunk_pos entry = instruction_location + jump_distance;
+
+    std::mutex result_mutex;
+    t_register_value result = 0;
+    bool has_result = false;
+    std::string trap_message;
+    std::atomic<bool> is_cancelled{false};
+
+    const uint64_t count = end > begin ? static_cast<uint64_t>(end - begin) : 0;
+
+    // Every batch runs on a VM thread of its own, so iterations of a batch share TLS. Results are reduced per batch first,
+    // the shared result is only locked once per batch.
+    state.parallel().run(count, grain, [&](const uint64_t batch_begin, const uint64_t batch_end) {
+        run_thread worker;
+        worker.tls = state.program->tls_template;
+
+        if (state.is_profiling())
+            worker.profile.enable(state.chunk);
+
+        t_local_stack batch_locals = locals;
+        t_register_value partial = 0;
+
+        try {
+            for (uint64_t i = batch_begin; i < batch_end && !is_cancelled.load(std::memory_order_relaxed); i++) {
+                batch_locals[0] = bit_util::bit_cast<int64_t, t_register_value>(begin + static_cast<int64_t>(i));
+
+                t_register_value value;
+
+                if (!execute_call(state, worker, chunk, literal_list, entry, batch_locals, value))
+                    throw vm_trap("ran out of its run budget");
+
+                if (result_reg > 0)
+                    partial = i == batch_begin ? value : _reduce(reduce, type, partial, value);
+            }
+        }
+        catch (const vm_trap& trap) {
+            std::lock_guard<std::mutex> lock(result_mutex);
+            is_cancelled.store(true, std::memory_order_relaxed);
+
+            if (trap_message.empty())
+                trap_message = "Parallel iteration " + std::to_string(bit_util::bit_cast<t_register_value, int64_t>(batch_locals[0])) + " trapped: " + trap.what();
+        }
+
+        if (worker.profile.is_enabled())
+            state.add_profile(worker.profile);
+
+        std::lock_guard<std::mutex> lock(result_mutex);
+
+        // The issuing thread waits for the loop, so its counters only take these merges meanwhile.
+        thread.alloc_stats.add(worker.alloc_stats);
+
+        if (result_reg == 0 || is_cancelled.load(std::memory_order_relaxed))
+            return;
+
+        result = has_result ? _reduce(reduce, type, result, partial) : partial;
+        has_result = true;
+    });
+
+    if (!trap_message.empty())
+        throw vm_trap(trap_message);
+
+    if (result_reg > 0)
+        top_frame.reg_copy_to(result_reg - 1, result);
+
+    thread.trace_event(instruction_location, TRACE_CALL, entry, result_reg);
+    thread.profile_event(instruction_location, count);
+    thread.burn_fuel(FUEL_CALL_COST);
+}
+
+// Longest path OP_FOPEN accepts.
+constexpr t_register_value FILE_PATH_MAX = 4096;
+
+static io_context& _file_io(run_state& state) {
+    if (!state.budget.allow_file_io)
+        throw vm_trap("File I/O is not allowed in this run.");
+
+    return state.io();
+}
+
+void instr_fopen(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value path_address = top_frame.reg_copy_from(thread.next());
+    const t_register_value path_size = top_frame.reg_copy_from(thread.next());
+    const uint8_t mode = thread.next();
+
+    if (path_size > FILE_PATH_MAX)
+        throw vm_trap("File path of " + std::to_string(path_size) + " bytes is too long.");
+
+    std::string path(path_size, '\0');
+    state.mread_bytes(reinterpret_cast<uint8_t*>(path.data()), path_address, path_size);
+
+    const int64_t file = _file_io(state).open(path, mode);
+    top_frame.reg_copy_to(target_reg, bit_util::bit_cast<int64_t, t_register_value>(file));
+}
+
+void instr_fclose(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value file = top_frame.reg_copy_from(thread.next());
+
+    const int64_t result = _file_io(state).close(file);
+    top_frame.reg_copy_to(target_reg, bit_util::bit_cast<int64_t, t_register_value>(result));
+}
+
+void instr_fread(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value file = top_frame.reg_copy_from(thread.next());
+    const t_register_value address = top_frame.reg_copy_from(thread.next());
+    const t_register_value size = top_frame.reg_copy_from(thread.next());
+    const t_register_value offset = top_frame.reg_copy_from(thread.next());
+
+    if (size > IO_TRANSFER_MAX)
+        throw vm_trap("File read of " + std::to_string(size) + " bytes is over the transfer limit.");
+
+    // The data only lands at OP_IO_WAIT, but a bad destination should trap here.
+    state.heap_view({ { address, size } }, [](uint8_t*) {});
+
+    const uint64_t request_id = _file_io(state).submit_read(file, address, size, offset);
+    top_frame.reg_copy_to(target_reg, request_id);
+}
+
+void instr_fwrite(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value file = top_frame.reg_copy_from(thread.next());
+    const t_register_value address = top_frame.reg_copy_from(thread.next());
+    const t_register_value size = top_frame.reg_copy_from(thread.next());
+    const t_register_value offset = top_frame.reg_copy_from(thread.next());
+
+    if (size > IO_TRANSFER_MAX)
+        throw vm_trap("File write of " + std::to_string(size) + " bytes is over the transfer limit.");
+
+    io_context& io = _file_io(state);
+    std::vector<uint8_t> data(size);
+    state.mread_bytes(data.data(), address, size);
+
+    const uint64_t request_id = io.submit_write(file, std::move(data), offset);
+    top_frame.reg_copy_to(target_reg, request_id);
+}
+
+void instr_io_wait(run_state& state, run_thread& thread, call_frame& top_frame) {
+    const t_register_id target_reg = thread.next();
+    const t_register_value request_id = top_frame.reg_copy_from(thread.next());
+
+    const std::shared_ptr<io_request> request = _file_io(state).take_request(request_id);
+    const int64_t result = request->wait();
+
+    if (request->kind == IO_READ && result > 0)
+        state.mwrite_bytes(request->heap_address, request->buffer.data(), result);
+
+    top_frame.reg_copy_to(target_reg, bit_util::bit_cast<int64_t, t_register_value>(result));
+}
@@ -0,0 +1,462 @@
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <deque>
+
+#include "io.hpp"
+#include "instructions.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define IO_POSIX
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#if defined(__linux__)
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#endif
+
+#if defined(IO_POSIX)
+
+static int _open_flags(const uint8_t mode) {
+    switch (mode) {
+        case FILE_READ:       return O_RDONLY;
+        case FILE_WRITE:      return O_WRONLY | O_CREAT | O_TRUNC;
+        case FILE_APPEND:     return O_WRONLY | O_CREAT | O_APPEND;
+        case FILE_READ_WRITE: return O_RDWR | O_CREAT;
+        default:              throw vm_trap("Unknown file mode " + std::to_string(mode) + '.');
+    }
+}
+
+// Runs each request as a blocking call on a small pool of threads.
+class _thread_backend : public io_backend {
+public:
+    _thread_backend() {
+        for (size_t i = 0; i < IO_WORKER_COUNT; i++)
+            _workers.emplace_back([this] { _work(); });
+    }
+
+    ~_thread_backend() override {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _is_stopping = true;
+        }
+
+        _condition.notify_all();
+
+        for (std::thread& worker : _workers)
+            worker.join();
+    }
+
+    void submit(io_request& request) override {
+        {
+            std::lock_guard<std::mutex> lock(_mutex);
+            _queue.emplace_back(&request);
+        }
+
+        _condition.notify_one();
+    }
+
+    const char* name() const override {
+        return "threads";
+    }
+private:
+    static int64_t _perform(io_request& request) {
+        ssize_t result = -1;
+
+        switch (request.kind) {
+            case IO_OPEN:  result = ::open(request.path.c_str(), request.flags | O_CLOEXEC, 0644); break;
+            case IO_CLOSE: result = ::close(request.fd); break;
+            case IO_READ:  result = ::pread(request.fd, request.buffer.data(), request.buffer.size(), request.offset); break;
+            case IO_WRITE: result = ::pwrite(request.fd, request.buffer.data(), request.buffer.size(), request.offset); break;
+        }
+
+        return result < 0 ? -static_cast<int64_t>(errno) : result;
+    }
+
+    void _work() {
+        while (true) {
+            io_request* request;
+
+            {
+                std::unique_lock<std::mutex> lock(_mutex);
+                _condition.wait(lock, [&] { return !_queue.empty() || _is_stopping; });
+
+                if (_queue.empty())
+                    return;
+
+                request = _queue.front();
+                _queue.pop_front();
+            }
+
+            request->complete(_perform(*request));
+        }
+    }
+
+    std::vector<std::thread> _workers;
+    std::deque<io_request*> _queue;
+    bool _is_stopping = false;
+
+    std::mutex _mutex;
+    std::condition_variable _condition;
+};
+
+#endif
+
+#if defined(__linux__)
+
+// Talks to the kernel through the raw syscalls, so there is no liburing dependency.
+// Submissions are serialized by a mutex, one thread reaps completions and wakes the waiting requests.
+class _uring_backend : public io_backend {
+public:
+    ~_uring_backend() override {
+        if (_ring_fd < 0)
+            return;
+
+        if (_reaper.joinable()) {
+            // A NOP without a request tells the reaper to stop. Everything submitted before it has completed by then
+            // as far as io_context is concerned, it only destroys the backend once no request is pending.
+            io_uring_sqe sqe{};
+            sqe.opcode = IORING_OP_NOP;
+            _push(sqe);
+            _reaper.join();
+        }
+
+        if (_sqes != nullptr)
+            munmap(_sqes, _sqes_size);
+
+        if (_cq_ring != nullptr && _cq_ring != _sq_ring)
+            munmap(_cq_ring, _cq_ring_size);
+
+        if (_sq_ring != nullptr)
+            munmap(_sq_ring, _sq_ring_size);
+
+        ::close(_ring_fd);
+    }
+
+    // Returns false if the kernel has no io_uring, it is disabled, or it is too old for file reads and writes.
+    bool init() {
+        io_uring_params params{};
+        _ring_fd = syscall(__NR_io_uring_setup, IO_RING_ENTRIES, &params);
+
+        // IORING_FEAT_RW_CUR_POS came with 5.6, the same release as IORING_OP_OPENAT, READ and WRITE.
+        if (_ring_fd < 0 || !(params.features & IORING_FEAT_RW_CUR_POS))
+            return false;
+
+        _sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(uint32_t);
+        _cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+
+        if (params.features & IORING_FEAT_SINGLE_MMAP)
+            _sq_ring_size = _cq_ring_size = std::max(_sq_ring_size, _cq_ring_size);
+
+        _sq_ring = _map(_sq_ring_size, IORING_OFF_SQ_RING);
+        _cq_ring = params.features & IORING_FEAT_SINGLE_MMAP ? _sq_ring : _map(_cq_ring_size, IORING_OFF_CQ_RING);
+
+        _sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        _sqes = static_cast<io_uring_sqe*>(_map(_sqes_size, IORING_OFF_SQES));
+
+        if (_sq_ring == nullptr || _cq_ring == nullptr || _sqes == nullptr)
+            return false;
+
+        uint8_t* const sq = static_cast<uint8_t*>(_sq_ring);
+        uint8_t* const cq = static_cast<uint8_t*>(_cq_ring);
+
+        _sq_tail = reinterpret_cast<uint32_t*>(sq + params.sq_off.tail);
+        _sq_mask = *reinterpret_cast<uint32_t*>(sq + params.sq_off.ring_mask);
+        _sq_array = reinterpret_cast<uint32_t*>(sq + params.sq_off.array);
+
+        _cq_head = reinterpret_cast<uint32_t*>(cq + params.cq_off.head);
+        _cq_tail = reinterpret_cast<uint32_t*>(cq + params.cq_off.tail);
+        _cq_mask = *reinterpret_cast<uint32_t*>(cq + params.cq_off.ring_mask);
+        _cqes = reinterpret_cast<io_uring_cqe*>(cq + params.cq_off.cqes);
+        _cq_entries = params.cq_entries;
+
+        _reaper = std::thread([this] { _reap(); });
+        return true;
+    }
+
+    void submit(io_request& request) override {
+        io_uring_sqe sqe{};
+        sqe.user_data = reinterpret_cast<uint64_t>(&request);
+
+        switch (request.kind) {
+            case IO_OPEN:
+                sqe.opcode = IORING_OP_OPENAT;
+                sqe.fd = AT_FDCWD;
+                sqe.addr = reinterpret_cast<uint64_t>(request.path.c_str());
+                sqe.len = 0644;
+                sqe.open_flags = request.flags | O_CLOEXEC;
+                break;
+            case IO_CLOSE:
+                sqe.opcode = IORING_OP_CLOSE;
+                sqe.fd = request.fd;
+                break;
+            case IO_READ:
+            case IO_WRITE:
+                sqe.opcode = request.kind == IO_READ ? IORING_OP_READ : IORING_OP_WRITE;
+                sqe.fd = request.fd;
+                sqe.addr = reinterpret_cast<uint64_t>(request.buffer.data());
+                sqe.len = request.buffer.size();
+                sqe.off = request.offset;
+                break;
+        }
+
+        if (const int error = _push(sqe))
+            request.complete(-error);
+    }
+
+    const char* name() const override {
+        return "io_uring";
+    }
+private:
+    void* _map(const size_t size, const uint64_t offset) {
+        void* const address = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, _ring_fd, offset);
+        return address == MAP_FAILED ? nullptr : address;
+    }
+
+    // Queues one entry and submits it. Returns 0, or errno if the kernel refused it.
+    int _push(const io_uring_sqe& sqe) {
+        std::unique_lock<std::mutex> lock(_submit_mutex);
+
+        // More entries in flight than the completion queue holds would overflow it.
+        _room_condition.wait(lock, [&] { return _in_flight < _cq_entries; });
+
+        const uint32_t tail = *_sq_tail;
+        const uint32_t index = tail & _sq_mask;
+
+        _sqes[index] = sqe;
+        _sq_array[index] = index;
+        __atomic_store_n(_sq_tail, tail + 1, __ATOMIC_RELEASE);
+
+        while (true) {
+            const int result = syscall(__NR_io_uring_enter, _ring_fd, 1, 0, 0, nullptr, 0);
+
+            if (result >= 0)
+                break;
+
+            if (errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+                // Take the entry back, it was never consumed.
+                __atomic_store_n(_sq_tail, tail, __ATOMIC_RELEASE);
+                return errno;
+            }
+        }
+
+        _in_flight++;
+        return 0;
+    }
+
+    void _reap() {
+        bool is_stopping = false;
+
+        while (!is_stopping) {
+            syscall(__NR_io_uring_enter, _ring_fd, 0, 1, IORING_ENTER_GETEVENTS, nullptr, 0);
+
+            uint32_t head = *_cq_head;
+            const uint32_t tail = __atomic_load_n(_cq_tail, __ATOMIC_ACQUIRE);
+            const uint32_t reaped = tail - head;
+
+            for (; head != tail; head++) {
+                const io_uring_cqe& cqe = _cqes[head & _cq_mask];
+
+                if (cqe.user_data == 0)
+                    is_stopping = true;
+                else
+                    reinterpret_cast<io_request*>(cqe.user_data)->complete(cqe.res);
+            }
+
+            __atomic_store_n(_cq_head, head, __ATOMIC_RELEASE);
+
+            if (reaped > 0) {
+                std::lock_guard<std::mutex> lock(_submit_mutex);
+                _in_flight -= reaped;
+                _room_condition.notify_all();
+            }
+        }
+    }
+
+    int _ring_fd = -1;
+
+    void* _sq_ring = nullptr;
+    void* _cq_ring = nullptr;
+    size_t _sq_ring_size = 0;
+    size_t _cq_ring_size = 0;
+
+    io_uring_sqe* _sqes = nullptr;
+    size_t _sqes_size = 0;
+
+    uint32_t* _sq_tail = nullptr;
+    uint32_t* _sq_array = nullptr;
+    uint32_t _sq_mask = 0;
+
+    uint32_t* _cq_head = nullptr;
+    uint32_t* _cq_tail = nullptr;
+    io_uring_cqe* _cqes = nullptr;
+    uint32_t _cq_mask = 0;
+    uint32_t _cq_entries = 0;
+
+    uint32_t _in_flight = 0;
+    std::mutex _submit_mutex;
+    std::condition_variable _room_condition;
+
+    std::thread _reaper;
+};
+
+#endif
+
+static std::unique_ptr<io_backend> _make_backend() {
+#if defined(__linux__)
+    if (IO_URING_ENABLED) {
+        auto backend = std::make_unique<_uring_backend>();
+
+        if (backend->init())
+            return backend;
+    }
+#endif
+
+#if defined(IO_POSIX)
+    return std::make_unique<_thread_backend>();
+#else
+    return nullptr;
+#endif
+}
+
+io_context::io_context()
+    : _backend(_make_backend()), _file_table(IO_FILE_MAX, -1) {}
+
+io_context::~io_context() {
+    for (auto& [id, request] : _pending_map)
+        request->wait();
+
+    _pending_map.clear();
+
+    for (const int fd : _file_table) {
+        if (fd < 0)
+            continue;
+
+        io_request request;
+        request.kind = IO_CLOSE;
+        request.fd = fd;
+
+        _backend->submit(request);
+        request.wait();
+    }
+}
+
+int io_context::_fd(const uint64_t file) {
+    if (file >= _file_table.size() || _file_table[file] < 0)
+        throw vm_trap("File handle " + std::to_string(file) + " is not open.");
+
+    return _file_table[file];
+}
+
+uint64_t io_context::_submit(std::shared_ptr<io_request> request) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const uint64_t request_id = _next_request_id++;
+    _backend->submit(*request);
+    _pending_map.emplace(request_id, std::move(request));
+
+    return request_id;
+}
+
+int64_t io_context::open(const std::string& path, const uint8_t mode) {
+#if defined(IO_POSIX)
+    io_request request;
+    request.kind = IO_OPEN;
+    request.path = path;
+    request.flags = _open_flags(mode);
+
+    _backend->submit(request);
+    const int64_t fd = request.wait();
+
+    if (fd < 0)
+        return fd;
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto slot = std::find(_file_table.begin(), _file_table.end(), -1);
+
+    if (slot == _file_table.end()) {
+        ::close(fd);
+        return -EMFILE;
+    }
+
+    *slot = fd;
+    return slot - _file_table.begin();
+#else
+    throw vm_trap("File I/O is not supported on this platform.");
+#endif
+}
+
+int64_t io_context::close(const uint64_t file) {
+    std::vector<std::shared_ptr<io_request>> in_flight;
+    io_request request;
+    request.kind = IO_CLOSE;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        request.fd = _fd(file);
+        _file_table[file] = -1;
+
+        for (auto& [id, pending] : _pending_map) {
+            if (pending->fd == request.fd)
+                in_flight.emplace_back(pending);
+        }
+    }
+
+    // The descriptor number could be reused as soon as it is closed, so nothing may still be using it.
+    for (std::shared_ptr<io_request>& pending : in_flight)
+        pending->wait();
+
+    _backend->submit(request);
+    return request.wait();
+}
+
+uint64_t io_context::submit_read(const uint64_t file, const t_register_value address, const uint32_t size, const uint64_t offset) {
+    if (size > IO_TRANSFER_MAX)
+        throw vm_trap("File read of " + std::to_string(size) + " bytes is over the transfer limit.");
+
+    auto request = std::make_shared<io_request>();
+    request->kind = IO_READ;
+    request->offset = offset;
+    request->heap_address = address;
+    request->buffer.resize(size);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        request->fd = _fd(file);
+    }
+
+    return _submit(std::move(request));
+}
+
+uint64_t io_context::submit_write(const uint64_t file, std::vector<uint8_t> data, const uint64_t offset) {
+    if (data.size() > IO_TRANSFER_MAX)
+        throw vm_trap("File write of " + std::to_string(data.size()) + " bytes is over the transfer limit.");
+
+    auto request = std::make_shared<io_request>();
+    request->kind = IO_WRITE;
+    request->offset = offset;
+    request->buffer = std::move(data);
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        request->fd = _fd(file);
+    }
+
+    return _submit(std::move(request));
+}
+
+std::shared_ptr<io_request> io_context::take_request(const uint64_t request_id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto found = _pending_map.find(request_id);
+
+    if (found == _pending_map.end())
+        throw vm_trap("I/O request " + std::to_string(request_id) + " is unknown or was already waited on.");
+
+    std::shared_ptr<io_request> request = std::move(found->second);
+    _pending_map.erase(found);
+
+    return request;
+}
@@ -0,0 +1,62 @@
+#include "isolate.hpp"
+#include "instructions.hpp"
+#include "module.hpp"
+
+run_thread& spawn_entry_thread(run_state& state) {
+    if (state.modules) {
+        const t_function_id entry = state.program->entry_function;
+        return state.spawn_thread(state.modules->body(entry), state.modules->literal_list(entry), 0);
+    }
+
+    return state.spawn_thread(state.program->entry_ip);
+}
+
+bool run_isolate(run_state& state) {
+    run_thread& main_thread = spawn_entry_thread(state);
+
+    execute_thread(state, main_thread);
+
+    const bool is_finished = !main_thread.is_suspended();
+
+    while (!state.are_threads_depleted()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    return is_finished;
+}
+
+isolate_lease::~isolate_lease() {
+    if (_isolate)
+        _pool->_release(std::move(_isolate));
+}
+
+isolate_lease isolate_pool::acquire() {
+    {
+        std::unique_lock<std::mutex> lock(_mutex);
+        _condition.wait(lock, [&] { return !_free_list.empty() || _isolate_count < _isolate_max; });
+
+        if (!_free_list.empty()) {
+            std::unique_ptr<run_state> isolate = std::move(_free_list.back());
+            _free_list.pop_back();
+
+            return isolate_lease(*this, std::move(isolate));
+        }
+
+        _isolate_count++;
+    }
+
+    // Built outside the lock, other workers can take returned isolates meanwhile.
+    return isolate_lease(*this, std::make_unique<run_state>(_program, _budget, _heap_cap));
+}
+
+void isolate_pool::_release(std::unique_ptr<run_state> isolate) {
+    while (!isolate->are_threads_depleted()) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+
+    isolate->reset();
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    _free_list.emplace_back(std::move(isolate));
+    _condition.notify_one();
+}
@@ -2,20 +2,106 @@
 #include <fstream>
 
 #include "instructions.hpp"
+#include "module.hpp"
+#include "compress.hpp"
+#include "isolate.hpp"
 
 constexpr bool WRITE_MODE = true;
+constexpr bool HEAP_REPORT_MODE = false;
+
+// Records the last instructions of every thread, dumped on traps and at exit. Decode with livm-trace.
+constexpr bool TRACE_MODE = false;
+constexpr auto TRACE_PATH = "livm.trace";
+
+// Counts every jump, branch and call of the chunk and writes them at exit. Feed the file to livm-opt --profile.
+constexpr bool PROFILE_MODE = false;
+constexpr auto PROFILE_PATH = "livm.profile";
+
+// 0 lets the heap grow without bound.
+constexpr t_heap_address HEAP_CAP = 0;
+
+// Threads are preempted every FUEL_SLICE units of fuel (bytes jumped backwards plus FUEL_CALL_COST per call).
+// A thread that spends RUN_FUEL_LIMIT fuel or runs for RUN_TIME_LIMIT is suspended. 0 disables each.
+// The limits are checked between slices, so with FUEL_SLICE at 0 they use DEFAULT_FUEL_SLICE.
+constexpr uint64_t FUEL_SLICE = 0;
+constexpr uint64_t RUN_FUEL_LIMIT = 0;
+constexpr std::chrono::milliseconds RUN_TIME_LIMIT{0};
+
+// Runs the program this many times on a pool of isolates, one per core, all sharing the loaded program.
+// 0 runs it once, the usual way.
+constexpr size_t ISOLATE_RUNS = 0;
+
+// Lets the program open files with OP_FOPEN, relative paths resolve against the working directory.
+constexpr bool FILE_IO_MODE = false;
+
+void print_heap_report(run_state& state) {
+    const heap_stats stats = state.get_heap_stats();
+
+    std::string buffer = "Heap: " + std::to_string(stats.heap_size) + " bytes, "
+        + std::to_string(stats.live_bytes) + " live, "
+        + std::to_string(stats.free_bytes) + " free in " + std::to_string(stats.free_block_count) + " blocks, "
+        + "largest free block " + std::to_string(stats.largest_free_block) + '\n';
+
+    for (size_t id = 0; id < state.thread_count(); id++) {
+        const thread_alloc_stats& thread_stats = state.get_thread(id).alloc_stats;
+
+        buffer += "Thread " + std::to_string(id) + ": "
+            + std::to_string(thread_stats.alloc_count.load()) + " allocs (" + std::to_string(thread_stats.alloc_bytes.load()) + " bytes), "
+            + std::to_string(thread_stats.free_count.load()) + " frees (" + std::to_string(thread_stats.free_bytes.load()) + " bytes)\n";
+
+        for (int bucket = 0; bucket < ALLOC_HISTOGRAM_BUCKETS; bucket++) {
+            const uint64_t count = thread_stats.size_histogram[bucket].load();
+
+            if (count != 0)
+                buffer += "    " + std::to_string(1ULL << bucket) + "+ bytes: " + std::to_string(count) + '\n';
+        }
+    }
+
+    thread_safe_print(buffer);
+}
 
 // Takes in a fully initialized state and runs bytecode.
 void execute(run_state& state) {
     // Execute thread 0
     execute_thread(state, state.get_thread(0));
 
+    if (state.get_thread(0).is_suspended())
+        thread_safe_print("Main thread suspended at ip " + std::to_string(state.get_thread(0).ip) + ", run budget exhausted.\n");
+
     // Yield for other threads to finish.
     while (!state.are_threads_depleted()) {
         std::this_thread::sleep_for(std::chrono::milliseconds(1));
     }
 
     thread_safe_print("Execution finished on all threads.\n");
+
+    if constexpr (HEAP_REPORT_MODE)
+        print_heap_report(state);
+}
+
+void run_isolates(run_state_initializer& init) {
+    const size_t worker_count = std::max(1u, std::thread::hardware_concurrency());
+    isolate_pool pool(std::make_shared<const run_program>(init), init.budget, init.heap_cap, worker_count);
+
+    std::atomic<size_t> next_run{0};
+    std::vector<std::thread> workers;
+
+    const auto start = std::chrono::steady_clock::now();
+
+    for (size_t i = 0; i < worker_count; i++) {
+        workers.emplace_back([&] {
+            while (next_run.fetch_add(1, std::memory_order_relaxed) < ISOLATE_RUNS) {
+                isolate_lease isolate = pool.acquire();
+                run_isolate(*isolate);
+            }
+        });
+    }
+
+    for (std::thread& worker : workers)
+        worker.join();
+
+    const auto elapsed = std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now() - start);
+    thread_safe_print(std::to_string(ISOLATE_RUNS) + " runs on " + std::to_string(worker_count) + " isolates took " + std::to_string(elapsed.count()) + " ms.\n");
 }
 
 // Assumes the chunk is already initialized. Parses the first few instructions and initializes the constant table.
@@ -51,12 +137,46 @@ bool load_constants(run_state_initializer& init) {
     return true;
 }
 
+// Reads the TLS segment declaration that follows the static memory size when CHUNK_TLS_FLAG is set.
+bool load_tls_segment(run_state_initializer& init) {
+    if (init.chunk.size() - init.ip < 8) {
+        thread_safe_print("Chunk has a truncated TLS segment.\n");
+        return false;
+    }
+
+    init.tls_size = _call_mergel_32(init.chunk, init.ip);
+    const uint32_t template_size = _call_mergel_32(init.chunk, init.ip);
+
+    if (template_size > init.tls_size || init.chunk.size() - init.ip < template_size) {
+        thread_safe_print("Chunk has a malformed TLS segment.\n");
+        return false;
+    }
+
+    init.tls_template.assign(init.chunk.begin() + init.ip, init.chunk.begin() + init.ip + template_size);
+    init.ip += template_size;
+
+    return true;
+}
+
 bool open_file(run_state_initializer& init, const std::string& path) {
     if (!std::filesystem::exists(path)) {
         thread_safe_print('\'' + path + "' is not a valid file.\n");
         return false;
     }
 
+    // Compressed chunks decode into the same buffer a plain chunk is read into.
+    if (is_compressed_chunk(path)) {
+        try {
+            init.chunk = read_compressed_chunk(path);
+        }
+        catch (const vm_trap& error) {
+            thread_safe_print("Failed to load chunk: " + std::string(error.what()) + '\n');
+            return false;
+        }
+
+        return true;
+    }
+
     std::ifstream file(path, std::ios::binary | std::ios::ate);
 
     if (!file.is_open()) {
@@ -79,29 +199,82 @@ bool open_file(run_state_initializer& init, const std::string& path) {
     return true;
 }
 
+// Reads the entry module's header and the body of its entry function. Everything else loads as it is called.
+bool open_module(run_state_initializer& init, const std::string& path) {
+    init.modules = std::make_shared<module_linker>(std::filesystem::path(path).parent_path());
+
+    try {
+        init.entry_function = init.modules->load_entry(path);
+        init.modules->body(init.entry_function);
+    }
+    catch (const vm_trap& error) {
+        thread_safe_print("Failed to load module: " + std::string(error.what()) + '\n');
+        return false;
+    }
+
+    init.static_memory_size = init.modules->static_memory_size();
+
+    return true;
+}
+
 // Does not return whether or not the execution was a success.
 // Only returns whether or not constant and file loading was a success.
 bool run(const std::string& path) {    
     run_state_initializer init;
 
-    if (!open_file(init, path))
-        return false;
+    init.heap_cap = HEAP_CAP;
+    init.budget.fuel_slice = FUEL_SLICE;
+    init.budget.run_fuel_limit = RUN_FUEL_LIMIT;
+    init.budget.run_time_limit = RUN_TIME_LIMIT;
+    init.budget.allow_file_io = FILE_IO_MODE;
 
-    // Load static memory
-    init.static_memory_size = _call_mergel_32(init.chunk, init.ip);
+    if (is_module_file(path)) {
+        if (!open_module(init, path))
+            return false;
+    }
+    else {
+        if (!open_file(init, path))
+            return false;
 
-    // <-IP-> +++++++->CONSTANTS<-++++++++++++++->BC<-+++++++
+        // Load static memory
+        const uint32_t static_memory_field = _call_mergel_32(init.chunk, init.ip);
+        init.static_memory_size = static_memory_field & ~CHUNK_TLS_FLAG;
 
-    if (!load_constants(init))
-        return false;
+        if ((static_memory_field & CHUNK_TLS_FLAG) && !load_tls_segment(init))
+            return false;
+
+        // <-IP-> +++++++->CONSTANTS<-++++++++++++++->BC<-+++++++
+
+        if (!load_constants(init))
+            return false;
 
-    // +++++++->CONSTANTS<-<-IP->++++++++++++++->BC<-+++++++
+        // +++++++->CONSTANTS<-<-IP->++++++++++++++->BC<-+++++++
+    }
+
+    if constexpr (ISOLATE_RUNS > 0) {
+        run_isolates(init);
+        return true;
+    }
 
     run_state state(init);
-    state.spawn_thread(init.ip); // Spawn main thread after constant reading.
+
+    if constexpr (TRACE_MODE)
+        state.enable_tracing(TRACE_PATH);
+
+    if constexpr (PROFILE_MODE)
+        state.enable_profiling(PROFILE_PATH);
+
+    // Spawn main thread after constant reading.
+    spawn_entry_thread(state);
 
     execute(state);
 
+    if constexpr (TRACE_MODE)
+        state.dump_trace();
+
+    if constexpr (PROFILE_MODE)
+        state.dump_profile();
+
     // +++++++->CONSTANTS<-++++++++++++++->BC<-+++++++<-IP->
 
     return true;
@@ -145,7 +318,7 @@ int main(int argc, char* argv[]) {
 
     _8(OP_OUT) _8(VAL_I32) _8(4)                // output our retrieved value from the heap
 
-    _8(OP_RETURN)                               // end the program
+    _8(OP_RETURN) _8(0)                         // end the program
     
     #undef B8
     #undef B16
@@ -0,0 +1,275 @@
+#include "module.hpp"
+#include "bytecode.hpp"
+
+constexpr char MODULE_MAGIC[4] = { 'L', 'M', 'O', 'D' };
+
+// Bounds checked reads over a module header. Unlike chunks, modules come from anywhere, so nothing is assumed.
+struct _header_reader {
+    _header_reader(const t_chunk& header, const std::string& module_name)
+        : header(header), module_name(module_name) {}
+
+    const t_chunk& header;
+    const std::string& module_name;
+    t_chunk_pos pos = 0;
+
+    inline void require(const size_t size) const {
+        if (pos + size > header.size())
+            throw vm_trap("Module '" + module_name + "' has a truncated header.");
+    }
+
+    inline uint8_t u8() {
+        require(1);
+        return header[pos++];
+    }
+
+    inline uint16_t u16() {
+        require(2);
+        return _call_mergel_16(header, pos);
+    }
+
+    inline uint32_t u32() {
+        require(4);
+        return _call_mergel_32(header, pos);
+    }
+
+    inline uint64_t u64() {
+        require(8);
+        return _call_mergel_64(header, pos);
+    }
+
+    inline std::string string() {
+        const uint8_t length = u8();
+        require(length);
+
+        std::string result(header.begin() + pos, header.begin() + pos + length);
+        pos += length;
+
+        return result;
+    }
+};
+
+bool is_module_file(const std::filesystem::path& path) {
+    std::ifstream file(path, std::ios::binary);
+    char magic[sizeof(MODULE_MAGIC)];
+
+    return file.read(magic, sizeof(magic)) && std::equal(magic, magic + sizeof(magic), MODULE_MAGIC);
+}
+
+t_function_id module_linker::load_entry(const std::filesystem::path& path) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    const loaded_module& module = _load_module(path.stem().string(), path);
+    const auto entry = module.export_map.find(MODULE_ENTRY_FUNCTION);
+
+    if (entry == module.export_map.end())
+        throw vm_trap("Module '" + module.name + "' has no '" + MODULE_ENTRY_FUNCTION + "' function.");
+
+    return entry->second;
+}
+
+loaded_module& module_linker::_load_module(const std::string& name, const std::filesystem::path& path) {
+    auto module = std::make_unique<loaded_module>();
+    module->name = name;
+    module->file.open(path, std::ios::binary | std::ios::ate);
+
+    if (!module->file.is_open())
+        throw vm_trap("Module '" + name + "' not found at '" + path.string() + "'.");
+
+    const uint64_t file_size = module->file.tellg();
+    module->file.seekg(0, std::ios::beg);
+
+    // Magic and header size come first so the rest of the header can be read in one go.
+    t_chunk header(sizeof(MODULE_MAGIC) + 4);
+
+    if (!module->file.read(reinterpret_cast<char*>(header.data()), header.size()) || !std::equal(header.begin(), header.begin() + 4, MODULE_MAGIC))
+        throw vm_trap("'" + path.string() + "' is not a module.");
+
+    t_chunk_pos size_pos = sizeof(MODULE_MAGIC);
+    const uint32_t header_size = _call_mergel_32(header, size_pos);
+
+    if (header_size < header.size() || header_size > file_size)
+        throw vm_trap("Module '" + name + "' has a truncated header.");
+
+    header.resize(header_size);
+
+    if (!module->file.read(reinterpret_cast<char*>(header.data() + size_pos), header_size - size_pos))
+        throw vm_trap("Failed to read module '" + name + "'.");
+
+    _header_reader reader(header, module->name);
+    reader.pos = size_pos;
+
+    module->static_memory_size = reader.u32();
+
+    const uint16_t literal_count = reader.u16();
+
+    for (uint16_t i = 0; i < literal_count; i++) {
+        switch (reader.u8()) {
+            case 1: module->literal_list.emplace_back(reader.u8()); break;
+            case 2: module->literal_list.emplace_back(reader.u16()); break;
+            case 4: module->literal_list.emplace_back(reader.u32()); break;
+            case 8: module->literal_list.emplace_back(reader.u64()); break;
+            default:
+                throw vm_trap("Module '" + name + "' has a literal of unsupported size.");
+        }
+    }
+
+    const uint16_t import_count = reader.u16();
+
+    for (uint16_t i = 0; i < import_count; i++) {
+        std::string module_name = reader.string();
+        std::string symbol = reader.string();
+
+        module->import_list.push_back({ std::move(module_name), std::move(symbol), std::nullopt });
+    }
+
+    const uint16_t function_count = reader.u16();
+
+    if (_function_count + function_count > FUNCTION_TABLE_MAX)
+        throw vm_trap("Function table is full, module '" + name + "' can't be loaded.");
+
+    module->first_function = _function_count;
+    module->function_count = function_count;
+
+    for (uint16_t i = 0; i < function_count; i++) {
+        const uint32_t id = _function_count + i;
+        std::unique_ptr<function_entry[]>& page = _function_pages[id / FUNCTION_PAGE_SIZE];
+
+        if (!page)
+            page = std::make_unique<function_entry[]>(FUNCTION_PAGE_SIZE);
+
+        function_entry& function = page[id % FUNCTION_PAGE_SIZE];
+        function.name = reader.string();
+        function.owner = module.get();
+        function.body_offset = reader.u32();
+        function.body_size = reader.u32();
+
+        if (function.body_offset < header_size || static_cast<uint64_t>(function.body_offset) + function.body_size > file_size)
+            throw vm_trap("Module '" + name + "' has a function body outside of the file.");
+
+        if (function.name.empty())
+            function.name = '#' + std::to_string(i);
+        else
+            module->export_map.emplace(function.name, id);
+    }
+
+    // Ids are only handed out once the whole header parsed, a bad module leaves the table as it was.
+    _function_count += function_count;
+
+    loaded_module& result = *module;
+    _module_map.emplace(name, module.get());
+    _module_list.emplace_back(std::move(module));
+
+    return result;
+}
+
+const t_chunk& module_linker::_load_body(const t_function_id id) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    function_entry& function = _function(id);
+
+    // Another thread may have loaded it while this one waited for the lock.
+    if (const t_chunk* body = function.body.load(std::memory_order_acquire))
+        return *body;
+
+    loaded_module& module = *function.owner;
+    auto body = std::make_unique<t_chunk>(function.body_size);
+
+    module.file.clear();
+    module.file.seekg(function.body_offset, std::ios::beg);
+
+    if (!module.file.read(reinterpret_cast<char*>(body->data()), body->size()))
+        throw vm_trap("Failed to read function '" + function.name + "' of module '" + module.name + "'.");
+
+    _link_body(module, function, *body);
+
+    function.body_storage = std::move(body);
+    function.body.store(function.body_storage.get(), std::memory_order_release);
+
+    return *function.body_storage;
+}
+
+t_function_id module_linker::_resolve_import(loaded_module& module, const uint16_t import) {
+    loaded_module::import& entry = module.import_list[import];
+
+    if (entry.resolved_id)
+        return *entry.resolved_id;
+
+    const auto found = _module_map.find(entry.module_name);
+    loaded_module& target = found != _module_map.end()
+        ? *found->second
+        : _load_module(entry.module_name, _search_directory / (entry.module_name + MODULE_EXTENSION));
+
+    const auto symbol = target.export_map.find(entry.symbol);
+
+    if (symbol == target.export_map.end())
+        throw vm_trap("Module '" + entry.module_name + "' has no function '" + entry.symbol + "', imported by '" + module.name + "'.");
+
+    entry.resolved_id = symbol->second;
+    return symbol->second;
+}
+
+// Checks that every instruction decodes, stays in bounds and jumps to the start of an instruction of the same body.
+// FN operands are rewritten to global function ids on the way.
+void module_linker::_link_body(loaded_module& module, const function_entry& function, t_chunk& body) {
+    const auto fail = [&](const std::string& reason, const t_chunk_pos pos) {
+        throw vm_trap("Function '" + function.name + "' of module '" + module.name + "' failed verification: " + reason + " at " + std::to_string(pos) + '.');
+    };
+
+    std::vector<bool> instruction_starts(body.size(), false);
+    std::vector<std::pair<t_chunk_pos, int64_t>> target_list;
+
+    decoded_instruction instruction;
+    t_chunk_pos pos = 0;
+
+    while (pos < body.size()) {
+        if (!decode_instruction(body, pos, instruction))
+            fail("unknown or truncated instruction", pos);
+
+        instruction_starts[pos] = true;
+
+        for (uint8_t i = 0; i < instruction.info->operand_count; i++) {
+            const uint64_t value = instruction.operands[i];
+
+            // Register operands are single bytes, every value names a register.
+            switch (instruction.info->operands[i]) {
+                case OPERAND_TYPE:
+                    if (value > VAL_F64)
+                        fail("unknown type", pos);
+                    break;
+                case OPERAND_LITERAL:
+                    if (value >= module.literal_list.size())
+                        fail("literal out of range", pos);
+                    break;
+                case OPERAND_FUNCTION: {
+                    if (value >= static_cast<uint64_t>(module.function_count) + module.import_list.size())
+                        fail("function out of range", pos);
+
+                    const t_function_id id = value < module.function_count
+                        ? module.first_function + value
+                        : _resolve_import(module, value - module.function_count);
+
+                    uint8_t b0, b1;
+                    bit_util::splitl_16(id, b0, b1);
+                    body[instruction.operand_positions[i]] = b0;
+                    body[instruction.operand_positions[i] + 1] = b1;
+                    break;
+                }
+                default:
+                    if (is_relative_code_operand(instruction.info->operands[i]))
+                        target_list.emplace_back(pos, relative_target(instruction, i));
+                    break;
+            }
+        }
+
+        pos += instruction.length;
+    }
+
+    // Falling off the end of a body would end the thread instead of returning.
+    if (body.empty() || !is_terminator(instruction.op))
+        fail("control reaches the end of the body", body.size());
+
+    for (const auto& [source, target] : target_list) {
+        if (target < 0 || target >= static_cast<int64_t>(body.size()) || !instruction_starts[target])
+            fail("jump to " + std::to_string(target), source);
+    }
+}
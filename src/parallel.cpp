@@ -0,0 +1,97 @@
+#include <algorithm>
+
+#include "parallel.hpp"
+
+parallel_pool::~parallel_pool() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _is_stopping = true;
+    }
+
+    _condition.notify_all();
+
+    for (std::thread& worker : _workers)
+        worker.join();
+}
+
+void parallel_pool::run(const uint64_t count, const uint64_t grain, const t_batch_func& func) {
+    if (count == 0)
+        return;
+
+    const uint64_t batch_grain = std::max<uint64_t>(grain, 1);
+
+    // Not worth waking anyone for.
+    if (count <= batch_grain) {
+        func(0, count);
+        return;
+    }
+
+    auto job = std::make_shared<_job>();
+    job->func = &func;
+    job->count = count;
+    job->grain = batch_grain;
+    job->batch_count = (count - 1) / batch_grain + 1;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+
+        if (_workers.empty()) {
+            const size_t worker_count = std::min<size_t>(PARALLEL_WORKER_MAX, std::max(1u, std::thread::hardware_concurrency()) - 1);
+
+            for (size_t i = 0; i < worker_count; i++)
+                _workers.emplace_back(&parallel_pool::_worker_loop, this);
+        }
+
+        _job_queue.emplace_back(job);
+    }
+
+    _condition.notify_all();
+    _work_on(*job);
+
+    {
+        std::unique_lock<std::mutex> lock(job->done_mutex);
+        job->done_condition.wait(lock, [&] { return job->done_batches == job->batch_count; });
+    }
+
+    std::lock_guard<std::mutex> lock(_mutex);
+    const auto queued = std::find(_job_queue.begin(), _job_queue.end(), job);
+
+    if (queued != _job_queue.end())
+        _job_queue.erase(queued);
+}
+
+void parallel_pool::_work_on(_job& job) {
+    for (uint64_t batch = job.next_batch.fetch_add(1); batch < job.batch_count; batch = job.next_batch.fetch_add(1)) {
+        const uint64_t begin = batch * job.grain;
+        (*job.func)(begin, std::min(begin + job.grain, job.count));
+
+        std::lock_guard<std::mutex> lock(job.done_mutex);
+
+        if (++job.done_batches == job.batch_count)
+            job.done_condition.notify_all();
+    }
+}
+
+void parallel_pool::_worker_loop() {
+    while (true) {
+        std::shared_ptr<_job> job;
+
+        {
+            std::unique_lock<std::mutex> lock(_mutex);
+            _condition.wait(lock, [&] { return _is_stopping || !_job_queue.empty(); });
+
+            if (_is_stopping)
+                return;
+
+            job = _job_queue.front();
+
+            // Every batch is claimed, the issuer only waits for the last ones to finish. Make way for the next job.
+            if (job->next_batch.load() >= job->batch_count) {
+                _job_queue.pop_front();
+                continue;
+            }
+        }
+
+        _work_on(*job);
+    }
+}
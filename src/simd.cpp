@@ -0,0 +1,338 @@
+#include <cstring>
+
+#include "simd.hpp"
+
+#if defined(__GNUC__)
+    #define SIMD_VECTOR_EXTENSIONS 1
+    #define SIMD_INLINE __attribute__((always_inline)) inline
+#else
+    #define SIMD_VECTOR_EXTENSIONS 0
+    #define SIMD_INLINE inline
+#endif
+
+#if SIMD_VECTOR_EXTENSIONS && (defined(__x86_64__) || defined(__i386__))
+    #define SIMD_AVX2 1
+#else
+    #define SIMD_AVX2 0
+#endif
+
+using namespace simd;
+
+// Vector widths in bytes. 0 runs the scalar loop only.
+constexpr size_t WIDTH_SCALAR = 0;
+constexpr size_t WIDTH_128 = 16;
+constexpr size_t WIDTH_256 = 32;
+
+enum _cpu_level : uint8_t {
+    CPU_SCALAR,
+    CPU_128,    // SSE2 on x86-64, NEON on arm64. Both are baseline, so no runtime check is needed.
+    CPU_256,    // AVX2
+};
+
+static _cpu_level _detect_cpu_level() {
+#if SIMD_AVX2
+    __builtin_cpu_init();
+
+    if (__builtin_cpu_supports("avx2"))
+        return CPU_256;
+#endif
+
+    return SIMD_VECTOR_EXTENSIONS ? CPU_128 : CPU_SCALAR;
+}
+
+static const _cpu_level cpu_level = _detect_cpu_level();
+
+template <typename T, size_t WIDTH>
+struct _lanes {
+#if SIMD_VECTOR_EXTENSIONS
+    typedef T type __attribute__((vector_size(WIDTH)));
+#endif
+    static constexpr size_t count = WIDTH / sizeof(T);
+};
+
+template <typename T>
+static inline T _load(const uint8_t* source, const size_t index) {
+    T value;
+    memcpy(&value, source + index * sizeof(T), sizeof(T));
+    return value;
+}
+
+template <typename T>
+static inline void _store(uint8_t* dest, const size_t index, const T value) {
+    memcpy(dest + index * sizeof(T), &value, sizeof(T));
+}
+
+// Works on scalars and vectors alike. Comparisons produce an integer 1 or 0 rather than a mask, the kernel converts it to the element type.
+// Operands are taken by reference, vector arguments passed by value would change ABI between the AVX2 and baseline builds.
+template <vector_op OP, typename V, typename R>
+static SIMD_INLINE void _apply(const V& a, const V& b, R& result) {
+    if constexpr (OP == VEC_ADD)        result = a + b;
+    else if constexpr (OP == VEC_SUB)   result = a - b;
+    else if constexpr (OP == VEC_MUL)   result = a * b;
+    else if constexpr (OP == VEC_DIV)   result = a / b;
+    else if constexpr (OP == VEC_MIN)   result = a < b ? a : b;
+    else if constexpr (OP == VEC_MAX)   result = a > b ? a : b;
+    else if constexpr (OP == VEC_MORE)  result = (a > b) & 1;
+    else if constexpr (OP == VEC_LESS)  result = (a < b) & 1;
+    else if constexpr (OP == VEC_EQUAL) result = (a == b) & 1;
+}
+
+template <reduce_op OP, typename V>
+static SIMD_INLINE void _combine(V& acc, const V& value) {
+    if constexpr (OP == RED_SUM)        acc = acc + value;
+    else if constexpr (OP == RED_MIN)   acc = value < acc ? value : acc;
+    else if constexpr (OP == RED_MAX)   acc = value > acc ? value : acc;
+}
+
+template <typename T, vector_op OP, size_t WIDTH>
+static SIMD_INLINE void _binary_kernel(uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count) {
+    size_t i = 0;
+
+#if SIMD_VECTOR_EXTENSIONS
+    if constexpr (WIDTH != WIDTH_SCALAR) {
+        using V = typename _lanes<T, WIDTH>::type;
+        constexpr size_t LANES = _lanes<T, WIDTH>::count;
+
+        for (; i + LANES <= count; i += LANES) {
+            V va, vb;
+            memcpy(&va, a + i * sizeof(T), WIDTH);
+            memcpy(&vb, b + i * sizeof(T), WIDTH);
+
+            V result;
+
+            // Comparisons yield a signed integer vector of the same width. Converting it writes 1.0 for floats, like the scalar loop.
+            if constexpr (OP >= VEC_MORE) {
+                decltype(va > vb) mask;
+                _apply<OP>(va, vb, mask);
+                result = __builtin_convertvector(mask, V);
+            } else {
+                _apply<OP>(va, vb, result);
+            }
+
+            memcpy(dest + i * sizeof(T), &result, WIDTH);
+        }
+    }
+#endif
+
+    for (; i < count; i++) {
+        T result;
+        _apply<OP>(_load<T>(a, i), _load<T>(b, i), result);
+        _store<T>(dest, i, result);
+    }
+}
+
+template <typename T, reduce_op OP, size_t WIDTH>
+static SIMD_INLINE T _reduce_kernel(const uint8_t* src, const size_t count) {
+    if (count == 0)
+        return 0;
+
+    T acc = OP == RED_SUM ? static_cast<T>(0) : _load<T>(src, 0);
+    size_t i = 0;
+
+#if SIMD_VECTOR_EXTENSIONS
+    if constexpr (WIDTH != WIDTH_SCALAR) {
+        using V = typename _lanes<T, WIDTH>::type;
+        constexpr size_t LANES = _lanes<T, WIDTH>::count;
+
+        if (count >= LANES) {
+            V vacc;
+            memcpy(&vacc, src, WIDTH);
+
+            for (i = LANES; i + LANES <= count; i += LANES) {
+                V value;
+                memcpy(&value, src + i * sizeof(T), WIDTH);
+                _combine<OP>(vacc, value);
+            }
+
+            T lanes[LANES];
+            memcpy(lanes, &vacc, WIDTH);
+
+            acc = lanes[0];
+            for (size_t lane = 1; lane < LANES; lane++)
+                _combine<OP>(acc, lanes[lane]);
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+        _combine<OP>(acc, _load<T>(src, i));
+
+    return acc;
+}
+
+template <typename T, size_t WIDTH>
+static SIMD_INLINE T _dot_kernel(const uint8_t* a, const uint8_t* b, const size_t count) {
+    T acc = 0;
+    size_t i = 0;
+
+#if SIMD_VECTOR_EXTENSIONS
+    if constexpr (WIDTH != WIDTH_SCALAR) {
+        using V = typename _lanes<T, WIDTH>::type;
+        constexpr size_t LANES = _lanes<T, WIDTH>::count;
+
+        if (count >= LANES) {
+            V vacc = {};
+
+            for (; i + LANES <= count; i += LANES) {
+                V va, vb;
+                memcpy(&va, a + i * sizeof(T), WIDTH);
+                memcpy(&vb, b + i * sizeof(T), WIDTH);
+                vacc += va * vb;
+            }
+
+            T lanes[LANES];
+            memcpy(lanes, &vacc, WIDTH);
+
+            for (size_t lane = 0; lane < LANES; lane++)
+                acc += lanes[lane];
+        }
+    }
+#endif
+
+    for (; i < count; i++)
+        acc += _load<T>(a, i) * _load<T>(b, i);
+
+    return acc;
+}
+
+// The AVX2 entry points are the only functions compiled for AVX2. The kernels are forced inline into them.
+#if SIMD_AVX2
+template <typename T, vector_op OP>
+__attribute__((target("avx2"))) static void _binary_256(uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count) {
+    _binary_kernel<T, OP, WIDTH_256>(dest, a, b, count);
+}
+
+template <typename T, reduce_op OP>
+__attribute__((target("avx2"))) static T _reduce_256(const uint8_t* src, const size_t count) {
+    return _reduce_kernel<T, OP, WIDTH_256>(src, count);
+}
+
+template <typename T>
+__attribute__((target("avx2"))) static T _dot_256(const uint8_t* a, const uint8_t* b, const size_t count) {
+    return _dot_kernel<T, WIDTH_256>(a, b, count);
+}
+#endif
+
+template <typename T, vector_op OP>
+static void _binary_dispatch(uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count) {
+    switch (cpu_level) {
+#if SIMD_AVX2
+        case CPU_256: _binary_256<T, OP>(dest, a, b, count); break;
+#endif
+        case CPU_128: _binary_kernel<T, OP, WIDTH_128>(dest, a, b, count); break;
+        default:      _binary_kernel<T, OP, WIDTH_SCALAR>(dest, a, b, count); break;
+    }
+}
+
+template <typename T, reduce_op OP>
+static T _reduce_dispatch(const uint8_t* src, const size_t count) {
+    switch (cpu_level) {
+#if SIMD_AVX2
+        case CPU_256: return _reduce_256<T, OP>(src, count);
+#endif
+        case CPU_128: return _reduce_kernel<T, OP, WIDTH_128>(src, count);
+        default:      return _reduce_kernel<T, OP, WIDTH_SCALAR>(src, count);
+    }
+}
+
+template <typename T>
+static T _dot_dispatch(const uint8_t* a, const uint8_t* b, const size_t count) {
+    switch (cpu_level) {
+#if SIMD_AVX2
+        case CPU_256: return _dot_256<T>(a, b, count);
+#endif
+        case CPU_128: return _dot_kernel<T, WIDTH_128>(a, b, count);
+        default:      return _dot_kernel<T, WIDTH_SCALAR>(a, b, count);
+    }
+}
+
+template <typename T>
+static void _binary_typed(const vector_op op, uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count) {
+    switch (op) {
+        case VEC_ADD:   _binary_dispatch<T, VEC_ADD>(dest, a, b, count); break;
+        case VEC_SUB:   _binary_dispatch<T, VEC_SUB>(dest, a, b, count); break;
+        case VEC_MUL:   _binary_dispatch<T, VEC_MUL>(dest, a, b, count); break;
+        case VEC_DIV:   _binary_dispatch<T, VEC_DIV>(dest, a, b, count); break;
+        case VEC_MIN:   _binary_dispatch<T, VEC_MIN>(dest, a, b, count); break;
+        case VEC_MAX:   _binary_dispatch<T, VEC_MAX>(dest, a, b, count); break;
+        case VEC_MORE:  _binary_dispatch<T, VEC_MORE>(dest, a, b, count); break;
+        case VEC_LESS:  _binary_dispatch<T, VEC_LESS>(dest, a, b, count); break;
+        case VEC_EQUAL: _binary_dispatch<T, VEC_EQUAL>(dest, a, b, count); break;
+    }
+}
+
+template <typename T>
+static t_register_value _reduce_typed(const reduce_op op, const uint8_t* src, const size_t count) {
+    T result = 0;
+
+    switch (op) {
+        case RED_SUM: result = _reduce_dispatch<T, RED_SUM>(src, count); break;
+        case RED_MIN: result = _reduce_dispatch<T, RED_MIN>(src, count); break;
+        case RED_MAX: result = _reduce_dispatch<T, RED_MAX>(src, count); break;
+    }
+
+    return bit_util::bit_cast<T, t_register_value>(result);
+}
+
+template <typename T>
+static t_register_value _dot_typed(const uint8_t* a, const uint8_t* b, const size_t count) {
+    return bit_util::bit_cast<T, t_register_value>(_dot_dispatch<T>(a, b, count));
+}
+
+size_t simd::element_size(const value_type type) {
+    switch (type) {
+        case VAL_U8:  case VAL_I8:  return 1;
+        case VAL_U16: case VAL_I16: return 2;
+        case VAL_U32: case VAL_I32: case VAL_F32: return 4;
+        case VAL_U64: case VAL_I64: case VAL_F64: return 8;
+        default:      return 0;
+    }
+}
+
+void simd::binary(const value_type type, const vector_op op, uint8_t* dest, const uint8_t* a, const uint8_t* b, const size_t count) {
+    switch (type) {
+        case VAL_U8:  _binary_typed<uint8_t>(op, dest, a, b, count); break;
+        case VAL_U16: _binary_typed<uint16_t>(op, dest, a, b, count); break;
+        case VAL_U32: _binary_typed<uint32_t>(op, dest, a, b, count); break;
+        case VAL_U64: _binary_typed<uint64_t>(op, dest, a, b, count); break;
+        case VAL_I8:  _binary_typed<int8_t>(op, dest, a, b, count); break;
+        case VAL_I16: _binary_typed<int16_t>(op, dest, a, b, count); break;
+        case VAL_I32: _binary_typed<int32_t>(op, dest, a, b, count); break;
+        case VAL_I64: _binary_typed<int64_t>(op, dest, a, b, count); break;
+        case VAL_F32: _binary_typed<float>(op, dest, a, b, count); break;
+        case VAL_F64: _binary_typed<double>(op, dest, a, b, count); break;
+        default: break;
+    }
+}
+
+t_register_value simd::reduce(const value_type type, const reduce_op op, const uint8_t* src, const size_t count) {
+    switch (type) {
+        case VAL_U8:  return _reduce_typed<uint8_t>(op, src, count);
+        case VAL_U16: return _reduce_typed<uint16_t>(op, src, count);
+        case VAL_U32: return _reduce_typed<uint32_t>(op, src, count);
+        case VAL_U64: return _reduce_typed<uint64_t>(op, src, count);
+        case VAL_I8:  return _reduce_typed<int8_t>(op, src, count);
+        case VAL_I16: return _reduce_typed<int16_t>(op, src, count);
+        case VAL_I32: return _reduce_typed<int32_t>(op, src, count);
+        case VAL_I64: return _reduce_typed<int64_t>(op, src, count);
+        case VAL_F32: return _reduce_typed<float>(op, src, count);
+        case VAL_F64: return _reduce_typed<double>(op, src, count);
+        default:      return 0;
+    }
+}
+
+t_register_value simd::dot(const value_type type, const uint8_t* a, const uint8_t* b, const size_t count) {
+    switch (type) {
+        case VAL_U8:  return _dot_typed<uint8_t>(a, b, count);
+        case VAL_U16: return _dot_typed<uint16_t>(a, b, count);
+        case VAL_U32: return _dot_typed<uint32_t>(a, b, count);
+        case VAL_U64: return _dot_typed<uint64_t>(a, b, count);
+        case VAL_I8:  return _dot_typed<int8_t>(a, b, count);
+        case VAL_I16: return _dot_typed<int16_t>(a, b, count);
+        case VAL_I32: return _dot_typed<int32_t>(a, b, count);
+        case VAL_I64: return _dot_typed<int64_t>(a, b, count);
+        case VAL_F32: return _dot_typed<float>(a, b, count);
+        case VAL_F64: return _dot_typed<double>(a, b, count);
+        default:      return 0;
+    }
+}
@@ -0,0 +1,1458 @@
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <bitset>
+#include <limits>
+#include <type_traits>
+#include <unordered_map>
+
+#include "bytecode.hpp"
+#include "typed_ops.hpp"
+#include "compress.hpp"
+
+// livm-opt <input chunk> <output chunk> [--verify] [--profile <profile>]
+// Rewrites a chunk (the format read by load_constants, plain or compressed) into a smaller one that behaves the same.
+// Passes repeat until nothing changes: unreachable code removal, jump threading, constant propagation and folding,
+// and dead store elimination. The literal pool is deduplicated and trimmed when the chunk is written back.
+// --profile takes a profile recorded on the input chunk (PROFILE_MODE in livm) and lays the code out by it afterwards:
+// hot functions first, the likely successor of each block right after it, and blocks that never ran at the end.
+// --verify runs both chunks and compares what they print.
+
+constexpr auto OPT_ROUND_MAX = 8;
+constexpr auto VERIFY_TIME_LIMIT = std::chrono::seconds(10);
+
+// The time limit is checked between slices, so this bounds how far past it a chunk can run.
+constexpr uint64_t VERIFY_FUEL_SLICE = 1 << 16;
+
+struct opt_instruction {
+    opcode op;
+    uint64_t operands[OPERAND_MAX] = {};
+    std::vector<t_register_id> args;
+
+    // Index of the instruction a relative code operand points at. The instruction count stands for the end of the chunk.
+    uint32_t target = 0;
+    bool is_dead = false;
+
+    // Where the instruction was in the input chunk, and what the profile counted there.
+    t_chunk_pos position = 0;
+    profile_site profile;
+
+    inline const opcode_info& info() const {
+        return opcode_schema[op];
+    }
+};
+
+struct opt_program {
+    t_static_address static_memory_size = 0;
+    bool has_tls = false;
+    t_static_address tls_size = 0;
+    t_static_memory tls_template;
+
+    t_literal_list literal_list;
+    std::vector<opt_instruction> code;
+};
+
+static inline bool _has_target(const opt_instruction& instruction) {
+    for (uint8_t i = 0; i < instruction.info().operand_count; i++) {
+        if (is_relative_code_operand(instruction.info().operands[i]))
+            return true;
+    }
+
+    return false;
+}
+
+static inline bool _is_jump(const opcode op) {
+    return op == OP_JUMP_I8 || op == OP_JUMP_I16;
+}
+
+static inline bool _is_branch(const opcode op) {
+    return op == OP_JUMP_IF_FALSE || op == OP_JUMP_IF_TRUE || op == OP_JUMP_IF_NOT_LESS_IMM || op == OP_JUMP_IF_NOT_MORE_IMM || op == OP_JUMP_IF_NOT_EQUAL_IMM;
+}
+
+// Targets of these start a new call frame rather than continuing the current one.
+static inline bool _is_call(const opcode op) {
+    return op == OP_CALL || op == OP_DESYNC || op == OP_TAIL_CALL || op == OP_PARALLEL_FOR;
+}
+
+// ================================================================================
+// Reading and writing
+
+static bool read_program(const t_chunk& chunk, opt_program& program, t_chunk_pos& code_start) {
+    t_chunk_pos pos = 0;
+
+    if (chunk.size() < 6) {
+        std::cerr << "Chunk is too small to have a header.\n";
+        return false;
+    }
+
+    const uint32_t static_memory_field = _call_mergel_32(chunk, pos);
+    program.static_memory_size = static_memory_field & ~CHUNK_TLS_FLAG;
+    program.has_tls = static_memory_field & CHUNK_TLS_FLAG;
+
+    if (program.has_tls) {
+        if (chunk.size() - pos < 10) {
+            std::cerr << "TLS segment is truncated.\n";
+            return false;
+        }
+
+        program.tls_size = _call_mergel_32(chunk, pos);
+        const uint32_t template_size = _call_mergel_32(chunk, pos);
+
+        if (template_size > program.tls_size || chunk.size() - pos < template_size + 2) {
+            std::cerr << "TLS segment is malformed.\n";
+            return false;
+        }
+
+        program.tls_template.assign(chunk.begin() + pos, chunk.begin() + pos + template_size);
+        pos += template_size;
+    }
+
+    const t_literal_id literal_count = _call_mergel_16(chunk, pos);
+
+    // Mirrors load_constants, including literals of unsupported size reading as 0 without consuming anything.
+    for (t_literal_id i = 0; i < literal_count; i++) {
+        if (pos >= chunk.size()) {
+            std::cerr << "Literal pool is truncated.\n";
+            return false;
+        }
+
+        const uint8_t literal_size = chunk[pos++];
+
+        if ((literal_size == 1 || literal_size == 2 || literal_size == 4 || literal_size == 8) && pos + literal_size > chunk.size()) {
+            std::cerr << "Literal pool is truncated.\n";
+            return false;
+        }
+
+        switch (literal_size) {
+            case 1: program.literal_list.emplace_back(chunk[pos++]); break;
+            case 2: program.literal_list.emplace_back(_call_mergel_16(chunk, pos)); break;
+            case 4: program.literal_list.emplace_back(_call_mergel_32(chunk, pos)); break;
+            case 8: program.literal_list.emplace_back(_call_mergel_64(chunk, pos)); break;
+            default: program.literal_list.emplace_back(0); break;
+        }
+    }
+
+    code_start = pos;
+
+    std::vector<int64_t> index_of(chunk.size() + 1, -1);
+    std::vector<int64_t> target_positions;
+    decoded_instruction decoded;
+
+    while (pos < chunk.size()) {
+        if (!decode_instruction(chunk, pos, decoded)) {
+            std::cerr << "Unknown or truncated instruction at " << pos << ".\n";
+            return false;
+        }
+
+        index_of[pos] = program.code.size();
+
+        opt_instruction& instruction = program.code.emplace_back();
+        instruction.op = decoded.op;
+        instruction.position = pos;
+        int64_t target_position = -1;
+
+        for (uint8_t i = 0; i < decoded.info->operand_count; i++) {
+            const operand_kind kind = decoded.info->operands[i];
+            instruction.operands[i] = decoded.operands[i];
+
+            if (kind == OPERAND_ARGS) {
+                for (uint64_t arg = 0; arg < decoded.operands[i]; arg++)
+                    instruction.args.emplace_back(chunk[decoded.operand_positions[i] + 1 + arg]);
+            }
+
+            if (is_relative_code_operand(kind))
+                target_position = relative_target(decoded, i);
+
+            const bool is_register = kind == OPERAND_REG || kind == OPERAND_DEST;
+
+            if ((is_register && decoded.operands[i] > REGISTER_COUNT) || (kind == OPERAND_LITERAL && decoded.operands[i] >= program.literal_list.size())) {
+                std::cerr << "Operand out of range at " << pos << ".\n";
+                return false;
+            }
+        }
+
+        for (const t_register_id arg : instruction.args) {
+            if (arg > REGISTER_COUNT) {
+                std::cerr << "Operand out of range at " << pos << ".\n";
+                return false;
+            }
+        }
+
+        target_positions.emplace_back(target_position);
+        pos += decoded.length;
+    }
+
+    index_of[chunk.size()] = program.code.size();
+
+    for (size_t i = 0; i < program.code.size(); i++) {
+        if (!_has_target(program.code[i]))
+            continue;
+
+        const int64_t target = target_positions[i];
+
+        if (target < code_start || target > static_cast<int64_t>(chunk.size()) || index_of[target] < 0) {
+            std::cerr << "Instruction " << i << " jumps to " << target << ", which is not the start of an instruction.\n";
+            return false;
+        }
+
+        program.code[i].target = index_of[target];
+    }
+
+    return true;
+}
+
+static inline uint8_t _literal_size(const t_register_value value) {
+    if (value <= UINT8_MAX)  return 1;
+    if (value <= UINT16_MAX) return 2;
+    if (value <= UINT32_MAX) return 4;
+    return 8;
+}
+
+static inline void _write_value(t_chunk& chunk, const uint64_t value, const t_chunk_pos size) {
+    for (t_chunk_pos i = 0; i < size; i++)
+        chunk.emplace_back((value >> (i * 8)) & 0xFF);
+}
+
+static inline bool _fits(const int64_t value, const t_chunk_pos size) {
+    const int64_t limit = int64_t(1) << (size * 8 - 1);
+    return value >= -limit && value < limit;
+}
+
+// Unconditional jumps get the short form whenever their distance allows it.
+static bool write_program(const opt_program& program, t_chunk& chunk) {
+    const std::vector<opt_instruction>& code = program.code;
+
+    // Only literals something still loads are kept, each value once.
+    t_literal_list literal_list;
+    std::unordered_map<t_register_value, t_literal_id> literal_ids;
+    std::vector<t_literal_id> load_ids(code.size(), 0);
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (code[i].op != OP_LOAD)
+            continue;
+
+        const t_register_value value = program.literal_list[code[i].operands[1]];
+        const auto [entry, is_new] = literal_ids.emplace(value, literal_list.size());
+
+        if (is_new)
+            literal_list.emplace_back(value);
+
+        load_ids[i] = entry->second;
+    }
+
+    _write_value(chunk, program.static_memory_size | (program.has_tls ? CHUNK_TLS_FLAG : 0), 4);
+
+    if (program.has_tls) {
+        _write_value(chunk, program.tls_size, 4);
+        _write_value(chunk, program.tls_template.size(), 4);
+        chunk.insert(chunk.end(), program.tls_template.begin(), program.tls_template.end());
+    }
+
+    _write_value(chunk, literal_list.size(), 2);
+
+    for (const t_register_value literal : literal_list) {
+        const uint8_t size = _literal_size(literal);
+
+        chunk.emplace_back(size);
+        _write_value(chunk, literal, size);
+    }
+
+    const auto instruction_size = [&](const size_t i, const bool is_short) {
+        if (_is_jump(code[i].op))
+            return is_short ? 2 : 3;
+
+        t_chunk_pos size = 1 + code[i].args.size();
+
+        for (uint8_t operand = 0; operand < code[i].info().operand_count; operand++)
+            size += operand_size(code[i].info().operands[operand]);
+
+        return static_cast<int>(size);
+    };
+
+    // Growing a jump only moves others further apart, so this settles after a few rounds.
+    std::vector<bool> is_short(code.size(), true);
+    std::vector<int64_t> positions(code.size() + 1);
+
+    while (true) {
+        int64_t pos = chunk.size();
+
+        for (size_t i = 0; i < code.size(); i++) {
+            positions[i] = pos;
+            pos += instruction_size(i, is_short[i]);
+        }
+
+        positions[code.size()] = pos;
+
+        bool is_changed = false;
+
+        for (size_t i = 0; i < code.size(); i++) {
+            if (_is_jump(code[i].op) && is_short[i] && !_fits(positions[code[i].target] - positions[i], 1)) {
+                is_short[i] = false;
+                is_changed = true;
+            }
+        }
+
+        if (!is_changed)
+            break;
+    }
+
+    for (size_t i = 0; i < code.size(); i++) {
+        const opt_instruction& instruction = code[i];
+        const int64_t length = instruction_size(i, is_short[i]);
+
+        if (_is_jump(instruction.op)) {
+            const int64_t offset = positions[instruction.target] - positions[i];
+
+            if (!_fits(offset, 2))
+                return false;
+
+            chunk.emplace_back(is_short[i] ? OP_JUMP_I8 : OP_JUMP_I16);
+            _write_value(chunk, offset, is_short[i] ? 1 : 2);
+            continue;
+        }
+
+        chunk.emplace_back(instruction.op);
+
+        for (uint8_t operand = 0; operand < instruction.info().operand_count; operand++) {
+            const operand_kind kind = instruction.info().operands[operand];
+            const t_chunk_pos size = operand_size(kind);
+            int64_t offset = 0;
+
+            switch (kind) {
+                case OPERAND_LITERAL:
+                    _write_value(chunk, load_ids[i], size);
+                    break;
+                case OPERAND_ARGS:
+                    chunk.emplace_back(instruction.args.size());
+                    chunk.insert(chunk.end(), instruction.args.begin(), instruction.args.end());
+                    break;
+                case OPERAND_BRANCH16:
+                case OPERAND_CALL32:
+                    offset = positions[instruction.target] - positions[i];
+
+                    if (kind == OPERAND_BRANCH16)
+                        offset -= length;
+
+                    if (!_fits(offset, size))
+                        return false;
+
+                    _write_value(chunk, offset, size);
+                    break;
+                default:
+                    _write_value(chunk, instruction.operands[operand], size);
+                    break;
+            }
+        }
+    }
+
+    return true;
+}
+
+// ================================================================================
+// Control flow
+
+// Drops dead instructions. Targets of dropped instructions move to the next instruction that stays.
+static void compact(opt_program& program) {
+    std::vector<opt_instruction>& code = program.code;
+    std::vector<uint32_t> remap(code.size() + 1);
+    uint32_t live_count = 0;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        remap[i] = live_count;
+
+        if (!code[i].is_dead)
+            live_count++;
+    }
+
+    remap[code.size()] = live_count;
+
+    std::vector<opt_instruction> result;
+    result.reserve(live_count);
+
+    for (opt_instruction& instruction : code) {
+        if (instruction.is_dead)
+            continue;
+
+        instruction.target = remap[instruction.target];
+        result.emplace_back(std::move(instruction));
+    }
+
+    code = std::move(result);
+}
+
+struct opt_block {
+    uint32_t start;
+    uint32_t end;
+    bool is_entry = false;
+
+    std::vector<uint32_t> successors;
+    std::vector<uint32_t> predecessors;
+};
+
+// Calls aren't edges. Their targets are entries, since a callee starts with a frame of its own.
+static std::vector<opt_block> build_blocks(const opt_program& program) {
+    const std::vector<opt_instruction>& code = program.code;
+    std::vector<bool> is_leader(code.size() + 1, false);
+    std::vector<bool> is_entry(code.size() + 1, false);
+
+    is_leader[0] = true;
+    is_entry[0] = true;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (_has_target(code[i])) {
+            is_leader[code[i].target] = true;
+            is_entry[code[i].target] = is_entry[code[i].target] || _is_call(code[i].op);
+        }
+
+        if (_has_target(code[i]) || is_terminator(code[i].op))
+            is_leader[i + 1] = true;
+    }
+
+    std::vector<opt_block> blocks;
+    std::vector<uint32_t> block_of(code.size() + 1, UINT32_MAX);
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (is_leader[i]) {
+            if (!blocks.empty())
+                blocks.back().end = i;
+
+            opt_block& block = blocks.emplace_back();
+            block.start = i;
+            block.is_entry = is_entry[i];
+        }
+
+        block_of[i] = blocks.size() - 1;
+    }
+
+    if (!blocks.empty())
+        blocks.back().end = code.size();
+
+    for (uint32_t b = 0; b < blocks.size(); b++) {
+        const opt_instruction& last = code[blocks[b].end - 1];
+
+        if ((_is_jump(last.op) || _is_branch(last.op)) && last.target < code.size())
+            blocks[b].successors.emplace_back(block_of[last.target]);
+
+        if (!is_terminator(last.op) && blocks[b].end < code.size())
+            blocks[b].successors.emplace_back(block_of[blocks[b].end]);
+
+        for (const uint32_t successor : blocks[b].successors)
+            blocks[successor].predecessors.emplace_back(b);
+    }
+
+    return blocks;
+}
+
+static bool remove_unreachable(opt_program& program) {
+    std::vector<opt_instruction>& code = program.code;
+    std::vector<bool> is_reached(code.size() + 1, false);
+    std::vector<uint32_t> worklist = { 0 };
+
+    while (!worklist.empty()) {
+        const uint32_t i = worklist.back();
+        worklist.pop_back();
+
+        if (i >= code.size() || is_reached[i])
+            continue;
+
+        is_reached[i] = true;
+
+        if (_has_target(code[i]))
+            worklist.emplace_back(code[i].target);
+
+        if (!is_terminator(code[i].op))
+            worklist.emplace_back(i + 1);
+    }
+
+    bool is_changed = false;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        if (!is_reached[i]) {
+            code[i].is_dead = true;
+            is_changed = true;
+        }
+    }
+
+    return is_changed;
+}
+
+// Jumps to jumps go straight to the final target, jumps to a return become the return, and jumps to the next instruction go away.
+static bool thread_jumps(opt_program& program) {
+    std::vector<opt_instruction>& code = program.code;
+    bool is_changed = false;
+
+    for (size_t i = 0; i < code.size(); i++) {
+        opt_instruction& instruction = code[i];
+
+        if (!_is_jump(instruction.op) && !_is_branch(instruction.op))
+            continue;
+
+        uint32_t target = instruction.target;
+
+        // Bounded so a cycle of jumps can't hang the pass.
+        for (size_t step = 0; step < code.size() && target < code.size() && _is_jump(code[target].op); step++)
+            target = code[target].target;
+
+        if (target != instruction.target) {
+            instruction.target = target;
+            is_changed = true;
+        }
+
+        if (_is_jump(instruction.op) && target < code.size() && code[target].op == OP_RETURN) {
+            instruction = code[target];
+            is_changed = true;
+        }
+        else if (instruction.target == i + 1) {
+            instruction.is_dead = true;
+            is_changed = true;
+        }
+    }
+
+    return is_changed;
+}
+
+// ================================================================================
+// Constant propagation and folding
+
+enum opt_value_kind : uint8_t {
+    VALUE_UNDEF,    // Not reached yet.
+    VALUE_CONST,
+    VALUE_VARYING,
+};
+
+struct opt_value {
+    opt_value_kind kind = VALUE_UNDEF;
+    t_register_value value = 0;
+
+    inline bool operator==(const opt_value& other) const {
+        return kind == other.kind && (kind != VALUE_CONST || value == other.value);
+    }
+};
+
+using opt_registers = std::array<opt_value, REGISTER_COUNT + 1>;
+
+static inline void _meet(opt_registers& state, const opt_registers& other) {
+    for (size_t reg = 0; reg <= REGISTER_COUNT; reg++) {
+        if (state[reg].kind == VALUE_UNDEF)
+            state[reg] = other[reg];
+        else if (other[reg].kind != VALUE_UNDEF && !(state[reg] == other[reg]))
+            state[reg].kind = VALUE_VARYING;
+    }
+}
+
+// The immediate that converts to exactly 'value' with type 'type', if there is one.
+static bool _as_immediate(const uint64_t type, const t_register_value value, int16_t& immediate) {
+    const auto truncated = [&](const auto typed) {
+        using T = decltype(typed);
+
+        if constexpr (std::is_floating_point_v<T>) {
+            if (!(typed >= INT16_MIN && typed <= INT16_MAX))
+                return false;
+        }
+
+        immediate = static_cast<int16_t>(typed);
+        return _immediate_as<T>(immediate) == bit_util::bit_cast<T, t_register_value>(typed);
+    };
+
+    switch (type) {
+        case VAL_U8:  return truncated(bit_util::bit_cast<t_register_value, uint8_t>(value));
+        case VAL_U16: return truncated(bit_util::bit_cast<t_register_value, uint16_t>(value));
+        case VAL_U32: return truncated(bit_util::bit_cast<t_register_value, uint32_t>(value));
+        case VAL_U64: return truncated(bit_util::bit_cast<t_register_value, uint64_t>(value));
+        case VAL_I8:  return truncated(bit_util::bit_cast<t_register_value, int8_t>(value));
+        case VAL_I16: return truncated(bit_util::bit_cast<t_register_value, int16_t>(value));
+        case VAL_I32: return truncated(bit_util::bit_cast<t_register_value, int32_t>(value));
+        case VAL_I64: return truncated(bit_util::bit_cast<t_register_value, int64_t>(value));
+        case VAL_F32: return truncated(bit_util::bit_cast<t_register_value, float>(value));
+        case VAL_F64: return truncated(bit_util::bit_cast<t_register_value, double>(value));
+        default:      return false;
+    }
+}
+
+template <typename FUNC>
+static inline t_register_value _fold(const uint64_t type, const t_register_value operand0, const t_register_value operand1, FUNC func) {
+    return _typed_binary(static_cast<value_type>(type), operand0, operand1, func);
+}
+
+static bool _fold_binary(const opcode op, const uint64_t type, const t_register_value operand0, const t_register_value operand1, t_register_value& result) {
+    if (!_is_numeric(type))
+        return false;
+
+    switch (op) {
+        case OP_B_ADD: case OP_B_ADD_IMM:   result = _fold(type, operand0, operand1, _typed_binary_add); return true;
+        case OP_B_SUB: case OP_B_SUB_IMM:   result = _fold(type, operand0, operand1, _typed_binary_sub); return true;
+        case OP_B_MUL: case OP_B_MUL_IMM:   result = _fold(type, operand0, operand1, _typed_binary_mul); return true;
+        case OP_B_MORE: case OP_B_MORE_IMM: result = _fold(type, operand0, operand1, _typed_binary_more); return true;
+        case OP_B_LESS: case OP_B_LESS_IMM: result = _fold(type, operand0, operand1, _typed_binary_less); return true;
+        case OP_B_EQUAL_IMM:                result = _fold(type, operand0, operand1, _typed_binary_equal); return true;
+        case OP_B_DIV: case OP_B_DIV_IMM:
+            if (!_is_safe_division(type, operand0, operand1))
+                return false;
+
+            result = _fold(type, operand0, operand1, _typed_binary_div);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Value the instruction writes to its DEST operand, if it only depends on constants.
+static bool evaluate(const opt_instruction& instruction, const opt_registers& state, const t_literal_list& literal_list, t_register_value& result) {
+    const uint64_t* operands = instruction.operands;
+
+    const auto known = [&](const uint64_t reg) {
+        return state[reg].kind == VALUE_CONST;
+    };
+
+    switch (instruction.op) {
+        case OP_LOAD:
+            result = literal_list[operands[1]];
+            return true;
+        case OP_LOAD_IMM8:
+        case OP_LOAD_IMM16:
+        case OP_LOAD_IMM32:
+        case OP_LOAD_IMM64:
+            result = operands[1];
+            return true;
+        case OP_B_ADD:
+        case OP_B_SUB:
+        case OP_B_MUL:
+        case OP_B_DIV:
+        case OP_B_MORE:
+        case OP_B_LESS:
+            return known(operands[2]) && known(operands[3])
+                && _fold_binary(instruction.op, operands[0], state[operands[2]].value, state[operands[3]].value, result);
+        case OP_B_EQUAL:
+            if (!known(operands[1]) || !known(operands[2]))
+                return false;
+
+            result = state[operands[1]].value == state[operands[2]].value ? 1ULL : 0ULL;
+            return true;
+        case OP_B_ADD_IMM:
+        case OP_B_SUB_IMM:
+        case OP_B_MUL_IMM:
+        case OP_B_DIV_IMM:
+        case OP_B_MORE_IMM:
+        case OP_B_LESS_IMM:
+        case OP_B_EQUAL_IMM:
+            return known(operands[2])
+                && _fold_binary(instruction.op, operands[0], state[operands[2]].value, _typed_immediate(operands[0], static_cast<int16_t>(operands[3])), result);
+        case OP_U_NOT:
+            if (!known(operands[1]))
+                return false;
+
+            result = state[operands[1]].value ^ 1ULL;
+            return true;
+        case OP_U_NEG:
+            if (!known(operands[1]))
+                return false;
+
+            result = state[operands[1]].value ^ (1ULL << 63);
+            return true;
+        default:
+            return false;
+    }
+}
+
+// Whether a branch with a constant condition is taken. Returns false if the condition isn't constant.
+static bool evaluate_branch(const opt_instruction& instruction, const opt_registers& state, bool& is_taken) {
+    const uint64_t* operands = instruction.operands;
+    t_register_value result;
+
+    switch (instruction.op) {
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            if (state[operands[0]].kind != VALUE_CONST)
+                return false;
+
+            is_taken = (state[operands[0]].value == 0ULL) == (instruction.op == OP_JUMP_IF_FALSE);
+            return true;
+        case OP_JUMP_IF_NOT_LESS_IMM:
+        case OP_JUMP_IF_NOT_MORE_IMM:
+        case OP_JUMP_IF_NOT_EQUAL_IMM: {
+            if (state[operands[1]].kind != VALUE_CONST || !_is_numeric(operands[0]))
+                return false;
+
+            const opcode compare = instruction.op == OP_JUMP_IF_NOT_LESS_IMM ? OP_B_LESS_IMM
+                : instruction.op == OP_JUMP_IF_NOT_MORE_IMM ? OP_B_MORE_IMM
+                : OP_B_EQUAL_IMM;
+
+            if (!_fold_binary(compare, operands[0], state[operands[1]].value, _typed_immediate(operands[0], static_cast<int16_t>(operands[2])), result))
+                return false;
+
+            is_taken = result == 0ULL;
+            return true;
+        }
+        default:
+            return false;
+    }
+}
+
+static void step(const opt_instruction& instruction, opt_registers& state, const t_literal_list& literal_list) {
+    t_register_value result;
+    const bool is_known = evaluate(instruction, state, literal_list, result);
+
+    for (uint8_t i = 0; i < instruction.info().operand_count; i++) {
+        const uint64_t value = instruction.operands[i];
+
+        switch (instruction.info().operands[i]) {
+            case OPERAND_DEST:
+                state[value] = is_known ? opt_value{ VALUE_CONST, result } : opt_value{ VALUE_VARYING, 0 };
+                break;
+            case OPERAND_RESULT:
+                if (value > 0)
+                    state[value - 1] = { VALUE_VARYING, 0 };
+                break;
+            default:
+                break;
+        }
+    }
+}
+
+// Cheapest instruction that puts 'value' in 'reg'.
+static opt_instruction load_instruction(const t_register_id reg, const t_register_value value, const t_literal_list& literal_list) {
+    opt_instruction instruction;
+    instruction.operands[0] = reg;
+    instruction.operands[1] = value;
+
+    if (value <= UINT8_MAX)
+        instruction.op = OP_LOAD_IMM8;
+    else if (value <= UINT16_MAX)
+        instruction.op = OP_LOAD_IMM16;
+    else if (value <= UINT32_MAX)
+        instruction.op = OP_LOAD_IMM32;
+    else {
+        instruction.op = OP_LOAD_IMM64;
+
+        // An existing literal is 4 bytes against 10.
+        for (size_t literal = 0; literal < literal_list.size(); literal++) {
+            if (literal_list[literal] == value) {
+                instruction.op = OP_LOAD;
+                instruction.operands[1] = literal;
+                break;
+            }
+        }
+    }
+
+    return instruction;
+}
+
+static inline opcode _immediate_form(const opcode op) {
+    switch (op) {
+        case OP_B_ADD:  return OP_B_ADD_IMM;
+        case OP_B_SUB:  return OP_B_SUB_IMM;
+        case OP_B_MUL:  return OP_B_MUL_IMM;
+        case OP_B_DIV:  return OP_B_DIV_IMM;
+        case OP_B_MORE: return OP_B_MORE_IMM;
+        case OP_B_LESS: return OP_B_LESS_IMM;
+        default:        return op;
+    }
+}
+
+static bool fold_constants(opt_program& program) {
+    std::vector<opt_instruction>& code = program.code;
+    std::vector<opt_block> blocks = build_blocks(program);
+
+    std::vector<opt_registers> in_states(blocks.size()), out_states(blocks.size());
+    std::vector<bool> is_visited(blocks.size(), false);
+
+    opt_registers varying;
+    varying.fill({ VALUE_VARYING, 0 });
+
+    // Values only move down the lattice, so this terminates.
+    for (bool is_changed = true; is_changed;) {
+        is_changed = false;
+
+        for (size_t b = 0; b < blocks.size(); b++) {
+            opt_registers state = blocks[b].is_entry ? varying : opt_registers{};
+
+            for (const uint32_t predecessor : blocks[b].predecessors) {
+                if (is_visited[predecessor])
+                    _meet(state, out_states[predecessor]);
+            }
+
+            in_states[b] = state;
+
+            for (uint32_t i = blocks[b].start; i < blocks[b].end; i++)
+                step(code[i], state, program.literal_list);
+
+            if (!is_visited[b] || !(state == out_states[b])) {
+                is_visited[b] = true;
+                out_states[b] = state;
+                is_changed = true;
+            }
+        }
+    }
+
+    bool is_changed = false;
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        opt_registers& state = in_states[b];
+
+        for (uint32_t i = blocks[b].start; i < blocks[b].end; i++) {
+            opt_instruction& instruction = code[i];
+            const int dest = instruction.info().operand_count > 0 && instruction.info().operands[0] == OPERAND_DEST ? 0
+                : instruction.info().operand_count > 1 && instruction.info().operands[1] == OPERAND_DEST ? 1
+                : -1;
+
+            t_register_value result;
+            bool is_taken;
+
+            if (dest >= 0 && evaluate(instruction, state, program.literal_list, result)) {
+                opt_instruction load = load_instruction(instruction.operands[dest], result, program.literal_list);
+
+                if (load.op != instruction.op) {
+                    instruction = load;
+                    is_changed = true;
+                }
+            }
+            else if (_immediate_form(instruction.op) != instruction.op && state[instruction.operands[3]].kind == VALUE_CONST) {
+                int16_t immediate;
+
+                if (_as_immediate(instruction.operands[0], state[instruction.operands[3]].value, immediate)) {
+                    instruction.op = _immediate_form(instruction.op);
+                    instruction.operands[3] = static_cast<uint16_t>(immediate);
+                    is_changed = true;
+                }
+            }
+            else if (evaluate_branch(instruction, state, is_taken)) {
+                if (is_taken) {
+                    const uint32_t target = instruction.target;
+                    const profile_site profile = instruction.profile;
+
+                    instruction = opt_instruction();
+                    instruction.op = OP_JUMP_I16;
+                    instruction.target = target;
+                    instruction.profile = profile;
+                }
+                else
+                    instruction.is_dead = true;
+
+                is_changed = true;
+            }
+
+            step(instruction, state, program.literal_list);
+        }
+    }
+
+    return is_changed;
+}
+
+// ================================================================================
+// Dead store elimination
+
+using opt_live = std::bitset<REGISTER_COUNT + 1>;
+
+// Instructions that only write their DEST register, and can't trap.
+static bool _is_pure(const opt_instruction& instruction) {
+    switch (instruction.op) {
+        case OP_LOAD:
+        case OP_LOAD_IMM8:
+        case OP_LOAD_IMM16:
+        case OP_LOAD_IMM32:
+        case OP_LOAD_IMM64:
+        case OP_B_ADD:
+        case OP_B_SUB:
+        case OP_B_MUL:
+        case OP_B_MORE:
+        case OP_B_LESS:
+        case OP_B_EQUAL:
+        case OP_B_ADD_IMM:
+        case OP_B_SUB_IMM:
+        case OP_B_MUL_IMM:
+        case OP_B_MORE_IMM:
+        case OP_B_LESS_IMM:
+        case OP_B_EQUAL_IMM:
+        case OP_U_NOT:
+        case OP_U_NEG:
+            return true;
+        case OP_B_DIV:
+            return instruction.operands[0] == VAL_F32 || instruction.operands[0] == VAL_F64;
+        case OP_B_DIV_IMM:
+            return _is_safe_division(instruction.operands[0], 0, _typed_immediate(instruction.operands[0], static_cast<int16_t>(instruction.operands[3])))
+                && static_cast<int16_t>(instruction.operands[3]) != -1;
+        default:
+            return false;
+    }
+}
+
+// Returns false if the instruction is a dead store, 'live' is left untouched then.
+static bool step_liveness(const opt_instruction& instruction, opt_live& live) {
+    opt_live uses;
+    int dest = -1;
+
+    for (uint8_t i = 0; i < instruction.info().operand_count; i++) {
+        const uint64_t value = instruction.operands[i];
+
+        switch (instruction.info().operands[i]) {
+            case OPERAND_REG:
+                uses.set(value);
+                break;
+            case OPERAND_DEST:
+                dest = value;
+                break;
+            case OPERAND_RESULT:
+                if (value > 0)
+                    live.reset(value - 1);
+                break;
+            default:
+                break;
+        }
+    }
+
+    for (const t_register_id arg : instruction.args)
+        uses.set(arg);
+
+    // A tail call keeps the registers of the frame it reuses.
+    if (instruction.op == OP_TAIL_CALL)
+        uses.set();
+
+    if (dest >= 0) {
+        if (!live.test(dest) && _is_pure(instruction))
+            return false;
+
+        live.reset(dest);
+    }
+
+    live |= uses;
+    return true;
+}
+
+static bool eliminate_dead_stores(opt_program& program) {
+    std::vector<opt_instruction>& code = program.code;
+    std::vector<opt_block> blocks = build_blocks(program);
+    std::vector<opt_live> live_in(blocks.size());
+
+    const auto live_out = [&](const size_t b) {
+        opt_live live;
+
+        for (const uint32_t successor : blocks[b].successors)
+            live |= live_in[successor];
+
+        return live;
+    };
+
+    // Live sets only grow, so this terminates.
+    for (bool is_changed = true; is_changed;) {
+        is_changed = false;
+
+        for (size_t b = blocks.size(); b-- > 0;) {
+            opt_live live = live_out(b);
+
+            for (uint32_t i = blocks[b].end; i-- > blocks[b].start;)
+                step_liveness(code[i], live);
+
+            if (live != live_in[b]) {
+                live_in[b] = live;
+                is_changed = true;
+            }
+        }
+    }
+
+    bool is_changed = false;
+
+    for (size_t b = 0; b < blocks.size(); b++) {
+        opt_live live = live_out(b);
+
+        for (uint32_t i = blocks[b].end; i-- > blocks[b].start;) {
+            if (!step_liveness(code[i], live)) {
+                code[i].is_dead = true;
+                is_changed = true;
+            }
+        }
+    }
+
+    return is_changed;
+}
+
+static void optimize(opt_program& program) {
+    for (int round = 0; round < OPT_ROUND_MAX; round++) {
+        bool is_changed = false;
+
+        is_changed |= remove_unreachable(program);
+        compact(program);
+
+        is_changed |= thread_jumps(program);
+        compact(program);
+
+        if (!program.code.empty()) {
+            is_changed |= fold_constants(program);
+            compact(program);
+
+            is_changed |= eliminate_dead_stores(program);
+            compact(program);
+        }
+
+        if (!is_changed)
+            break;
+    }
+}
+
+// ================================================================================
+// Profile guided layout
+
+static bool read_profile(const std::string& path, const t_chunk& chunk, std::vector<profile_site>& sites) {
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.is_open()) {
+        std::cerr << "Failed to open '" << path << "'.\n";
+        return false;
+    }
+
+    const t_chunk data((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+    constexpr t_chunk_pos header_size = sizeof(PROFILE_MAGIC) + 4 + 4 + 8 + 4;
+    constexpr t_chunk_pos site_size = 4 + 8 + 8;
+
+    if (data.size() < header_size || !std::equal(PROFILE_MAGIC, PROFILE_MAGIC + sizeof(PROFILE_MAGIC), data.begin())) {
+        std::cerr << "'" << path << "' is not a profile.\n";
+        return false;
+    }
+
+    t_chunk_pos pos = sizeof(PROFILE_MAGIC);
+    const uint32_t version = _call_mergel_32(data, pos);
+    const uint32_t chunk_size = _call_mergel_32(data, pos);
+    const uint64_t chunk_hash = _call_mergel_64(data, pos);
+    const uint32_t site_count = _call_mergel_32(data, pos);
+
+    if (version != PROFILE_VERSION) {
+        std::cerr << "Profile version " << version << " is not supported.\n";
+        return false;
+    }
+
+    if (chunk_size != chunk.size() || chunk_hash != profile_chunk_hash(chunk)) {
+        std::cerr << "Profile was recorded on a different chunk.\n";
+        return false;
+    }
+
+    if ((data.size() - pos) / site_size < site_count) {
+        std::cerr << "Profile is truncated.\n";
+        return false;
+    }
+
+    sites.assign(chunk.size(), profile_site());
+
+    for (uint32_t i = 0; i < site_count; i++) {
+        const uint32_t position = _call_mergel_32(data, pos);
+        const uint64_t executed = _call_mergel_64(data, pos);
+        const uint64_t taken = _call_mergel_64(data, pos);
+
+        if (position >= chunk.size()) {
+            std::cerr << "Profile has a malformed site at " << position << ".\n";
+            return false;
+        }
+
+        sites[position] = { executed, taken };
+    }
+
+    return true;
+}
+
+static void apply_profile(opt_program& program, const std::vector<profile_site>& sites) {
+    for (opt_instruction& instruction : program.code)
+        instruction.profile = sites[instruction.position];
+}
+
+// How often each block ran. Calls, jumps and branches give the edges into their targets, and what a branch didn't
+// send to its target fell through. Falling through only goes forward, so one pass in order settles the rest.
+static std::vector<uint64_t> block_counts(const opt_program& program, const std::vector<opt_block>& blocks, const std::vector<uint32_t>& block_of) {
+    const std::vector<opt_instruction>& code = program.code;
+    std::vector<uint64_t> counts(blocks.size(), 0);
+
+    // The main thread enters once.
+    counts[0] = 1;
+
+    for (const opt_instruction& instruction : code) {
+        if (_has_target(instruction) && instruction.target < code.size())
+            counts[block_of[instruction.target]] += instruction.profile.taken;
+    }
+
+    for (uint32_t b = 0; b + 1 < blocks.size(); b++) {
+        const opt_instruction& last = code[blocks[b].end - 1];
+
+        if (is_terminator(last.op))
+            continue;
+
+        if (_is_branch(last.op))
+            counts[b + 1] += last.profile.executed - std::min(last.profile.taken, last.profile.executed);
+        else if (_has_target(last))
+            counts[b + 1] += last.profile.executed; // Calls come back.
+        else
+            counts[b + 1] += counts[b];
+    }
+
+    return counts;
+}
+
+// A block that falls through to the end of the chunk ends the thread there. This stands for that successor.
+constexpr uint32_t LAYOUT_END = UINT32_MAX;
+
+// Reorders blocks by the profile attached to the instructions. Every block keeps its successors:
+// where the block it falls through to no longer follows it, the branch is inverted or a jump is added.
+// With 'is_splitting', blocks that never ran move to the end of the chunk. Returns the number of blocks that did.
+static size_t layout(opt_program& program, const bool is_splitting) {
+    const std::vector<opt_instruction>& code = program.code;
+    const std::vector<opt_block> blocks = build_blocks(program);
+    std::vector<uint32_t> block_of(code.size() + 1, LAYOUT_END);
+
+    for (uint32_t b = 0; b < blocks.size(); b++) {
+        for (uint32_t i = blocks[b].start; i < blocks[b].end; i++)
+            block_of[i] = b;
+    }
+
+    const std::vector<uint64_t> counts = block_counts(program, blocks, block_of);
+    const auto is_cold = [&](const uint32_t b) { return is_splitting && counts[b] == 0; };
+
+    // Functions are the entry blocks and whatever they reach without calls. A block reached from two entries
+    // stays with the first, and blocks nothing reaches stay with the block before them.
+    std::vector<uint32_t> function_of(blocks.size(), LAYOUT_END);
+    std::vector<std::vector<uint32_t>> functions;
+
+    for (uint32_t entry = 0; entry < blocks.size(); entry++) {
+        if (!blocks[entry].is_entry || function_of[entry] != LAYOUT_END)
+            continue;
+
+        std::vector<uint32_t> worklist = { entry };
+        function_of[entry] = functions.size();
+
+        while (!worklist.empty()) {
+            const uint32_t b = worklist.back();
+            worklist.pop_back();
+
+            for (const uint32_t successor : blocks[b].successors) {
+                if (function_of[successor] == LAYOUT_END) {
+                    function_of[successor] = functions.size();
+                    worklist.emplace_back(successor);
+                }
+            }
+        }
+
+        functions.emplace_back();
+    }
+
+    for (uint32_t b = 0; b < blocks.size(); b++) {
+        if (function_of[b] == LAYOUT_END)
+            function_of[b] = b > 0 ? function_of[b - 1] : 0;
+
+        functions[function_of[b]].emplace_back(b);
+    }
+
+    // Main stays first, since threads start at the top of the chunk. Other functions follow by how often they were entered.
+    std::vector<uint32_t> function_order(functions.size());
+
+    for (uint32_t f = 0; f < functions.size(); f++)
+        function_order[f] = f;
+
+    std::stable_sort(function_order.begin() + 1, function_order.end(), [&](const uint32_t f0, const uint32_t f1) {
+        return counts[functions[f0].front()] > counts[functions[f1].front()];
+    });
+
+    // Within a function, each block is followed by its hottest successor not placed yet. When there is none,
+    // the hottest block left starts the next chain. Ties keep the original order.
+    std::vector<uint32_t> order;
+    std::vector<uint32_t> cold_order;
+    std::vector<bool> is_placed(blocks.size(), false);
+
+    for (const uint32_t f : function_order) {
+        const std::vector<uint32_t>& function = functions[f];
+        uint32_t current = function.front();
+
+        if (f != 0 && is_cold(current))
+            current = LAYOUT_END;
+
+        while (current != LAYOUT_END) {
+            is_placed[current] = true;
+            order.emplace_back(current);
+
+            uint32_t next = LAYOUT_END;
+
+            for (const uint32_t successor : blocks[current].successors) {
+                if (is_placed[successor] || is_cold(successor) || function_of[successor] != f)
+                    continue;
+
+                if (next == LAYOUT_END || counts[successor] > counts[next] || (counts[successor] == counts[next] && successor < next))
+                    next = successor;
+            }
+
+            if (next == LAYOUT_END) {
+                for (const uint32_t b : function) {
+                    if (!is_placed[b] && !is_cold(b) && (next == LAYOUT_END || counts[b] > counts[next]))
+                        next = b;
+                }
+            }
+
+            current = next;
+        }
+
+        for (const uint32_t b : function) {
+            if (!is_placed[b])
+                cold_order.emplace_back(b);
+        }
+    }
+
+    order.insert(order.end(), cold_order.begin(), cold_order.end());
+
+    // Targets stay indices into the old code until every block has its new start.
+    std::vector<opt_instruction> result;
+    std::vector<uint32_t> new_start(blocks.size());
+
+    const auto old_start = [&](const uint32_t b) {
+        return b == LAYOUT_END ? static_cast<uint32_t>(code.size()) : blocks[b].start;
+    };
+
+    for (size_t n = 0; n < order.size(); n++) {
+        const uint32_t b = order[n];
+        new_start[b] = result.size();
+        result.insert(result.end(), code.begin() + blocks[b].start, code.begin() + blocks[b].end);
+
+        opt_instruction& last = result.back();
+
+        if (is_terminator(last.op))
+            continue;
+
+        const uint32_t fallthrough = blocks[b].end < code.size() ? b + 1 : LAYOUT_END;
+        const uint32_t next = n + 1 < order.size() ? order[n + 1] : LAYOUT_END;
+
+        if (fallthrough == next)
+            continue;
+
+        const bool is_invertible = last.op == OP_JUMP_IF_FALSE || last.op == OP_JUMP_IF_TRUE;
+
+        if (is_invertible && next != LAYOUT_END && last.target == blocks[next].start) {
+            last.op = last.op == OP_JUMP_IF_FALSE ? OP_JUMP_IF_TRUE : OP_JUMP_IF_FALSE;
+            last.target = old_start(fallthrough);
+            continue;
+        }
+
+        opt_instruction& jump = result.emplace_back();
+        jump.op = OP_JUMP_I16;
+        jump.target = old_start(fallthrough);
+    }
+
+    for (opt_instruction& instruction : result) {
+        if (_has_target(instruction))
+            instruction.target = instruction.target == code.size() ? result.size() : new_start[block_of[instruction.target]];
+    }
+
+    program.code = std::move(result);
+
+    // Jumps that now land right after themselves go away.
+    thread_jumps(program);
+    compact(program);
+
+    return std::count_if(counts.begin(), counts.end(), [](const uint64_t count) { return count > 0; });
+}
+
+// ================================================================================
+// Differential testing
+
+// Runs a chunk to completion and captures everything it prints. Returns false if it ran out of time.
+static bool run_chunk(const t_chunk& chunk, std::string& output, bool& is_multithreaded) {
+    opt_program program;
+    t_chunk_pos code_start;
+
+    if (!read_program(chunk, program, code_start))
+        return false;
+
+    run_state_initializer init;
+    init.chunk = chunk;
+    init.literal_list = program.literal_list;
+    init.static_memory_size = program.static_memory_size;
+    init.tls_size = program.tls_size;
+    init.tls_template = program.tls_template;
+    init.budget.run_time_limit = VERIFY_TIME_LIMIT;
+    init.budget.fuel_slice = VERIFY_FUEL_SLICE;
+
+    run_state state(init);
+    state.spawn_thread(code_start);
+
+    std::ostringstream capture;
+    std::streambuf* const previous = std::cout.rdbuf(capture.rdbuf());
+
+    execute_thread(state, state.get_thread(0));
+
+    while (!state.are_threads_depleted())
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+
+    std::cout.rdbuf(previous);
+
+    output = capture.str();
+    is_multithreaded = state.thread_count() > 1;
+
+    return !state.get_thread(0).is_suspended();
+}
+
+// Trap messages carry the ip, which moves when code is removed.
+static std::vector<std::string> _output_lines(const std::string& output, const bool is_sorted) {
+    std::vector<std::string> lines;
+    std::istringstream stream(output);
+
+    for (std::string line; std::getline(stream, line);) {
+        if (line.rfind("Trap at ip ", 0) == 0 && line.find(':') != std::string::npos)
+            line = "Trap" + line.substr(line.find(':'));
+
+        lines.emplace_back(line);
+    }
+
+    if (is_sorted)
+        std::sort(lines.begin(), lines.end());
+
+    return lines;
+}
+
+static bool verify(const t_chunk& original, const t_chunk& optimized) {
+    std::string original_output, optimized_output;
+    bool is_original_multithreaded, is_optimized_multithreaded;
+
+    if (!run_chunk(original, original_output, is_original_multithreaded)) {
+        std::cerr << "Original chunk did not finish within the time limit.\n";
+        return false;
+    }
+
+    if (!run_chunk(optimized, optimized_output, is_optimized_multithreaded)) {
+        std::cerr << "Optimized chunk did not finish within the time limit.\n";
+        return false;
+    }
+
+    // Desynced threads may interleave their output differently on every run, so only the lines are compared then.
+    const bool is_sorted = is_original_multithreaded || is_optimized_multithreaded;
+    const std::vector<std::string> original_lines = _output_lines(original_output, is_sorted);
+    const std::vector<std::string> optimized_lines = _output_lines(optimized_output, is_sorted);
+
+    for (size_t i = 0; i < std::max(original_lines.size(), optimized_lines.size()); i++) {
+        const std::string original_line = i < original_lines.size() ? original_lines[i] : "<none>";
+        const std::string optimized_line = i < optimized_lines.size() ? optimized_lines[i] : "<none>";
+
+        if (original_line != optimized_line) {
+            std::cerr << "Output differs at line " << i + 1 << ":\n    original:  " << original_line << "\n    optimized: " << optimized_line << '\n';
+            return false;
+        }
+    }
+
+    std::cout << "Verified, both chunks printed the same " << original_lines.size() << " lines.\n";
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    bool is_verifying = false;
+    std::string profile_path;
+    bool is_usage_valid = argc >= 3;
+
+    for (int i = 3; i < argc && is_usage_valid; i++) {
+        const std::string option = argv[i];
+
+        if (option == "--verify")
+            is_verifying = true;
+        else if (option == "--profile" && i + 1 < argc)
+            profile_path = argv[++i];
+        else
+            is_usage_valid = false;
+    }
+
+    if (!is_usage_valid) {
+        std::cout << "Usage: livm-opt <input chunk> <output chunk> [--verify] [--profile <profile>]\n";
+        return 1;
+    }
+
+    std::ifstream input_file(argv[1], std::ios::binary | std::ios::ate);
+
+    if (!input_file.is_open()) {
+        std::cerr << "Failed to open '" << argv[1] << "'.\n";
+        return 1;
+    }
+
+    t_chunk input(input_file.tellg());
+    input_file.seekg(0, std::ios::beg);
+
+    if (!input_file.read(reinterpret_cast<char*>(input.data()), input.size())) {
+        std::cerr << "Failed to read '" << argv[1] << "'.\n";
+        return 1;
+    }
+
+    // Compressed input is optimized as the chunk it decodes to. The output is always a plain chunk.
+    if (input.size() >= sizeof(COMPRESSED_MAGIC) && std::equal(input.begin(), input.begin() + sizeof(COMPRESSED_MAGIC), COMPRESSED_MAGIC)) {
+        try {
+            input = decompress_chunk(input);
+        }
+        catch (const vm_trap& error) {
+            std::cerr << error.what() << '\n';
+            return 1;
+        }
+    }
+
+    opt_program program;
+    t_chunk_pos code_start;
+
+    if (!read_program(input, program, code_start))
+        return 1;
+
+    std::vector<profile_site> sites;
+
+    if (!profile_path.empty()) {
+        if (!read_profile(profile_path, input, sites))
+            return 1;
+
+        apply_profile(program, sites);
+    }
+
+    const size_t instruction_count = program.code.size();
+    const size_t literal_count = program.literal_list.size();
+
+    optimize(program);
+
+    t_chunk output;
+
+    if (!write_program(program, output)) {
+        std::cerr << "Optimized code has a jump that no longer fits its encoding.\n";
+        return 1;
+    }
+
+    // Moving cold blocks to the end can stretch a branch past its 16 bit offset. Then they stay in their functions,
+    // and if even that doesn't fit, the chunk keeps the order it had.
+    if (!profile_path.empty() && !program.code.empty()) {
+        bool is_laid_out = false;
+
+        for (const bool is_splitting : { true, false }) {
+            opt_program laid_out = program;
+            const size_t hot_count = layout(laid_out, is_splitting);
+            t_chunk laid_out_output;
+
+            if (!write_program(laid_out, laid_out_output))
+                continue;
+
+            std::cout << "Layout: " << hot_count << " of " << build_blocks(program).size() << " blocks ran"
+                << (is_splitting ? ", the rest moved to the end.\n" : ", cold blocks kept in place to fit jump offsets.\n");
+
+            program = std::move(laid_out);
+            output = std::move(laid_out_output);
+            is_laid_out = true;
+            break;
+        }
+
+        if (!is_laid_out)
+            std::cout << "Layout skipped, the reordered code has a jump that does not fit its encoding.\n";
+    }
+
+    std::ofstream output_file(argv[2], std::ios::binary);
+
+    if (!output_file.write(reinterpret_cast<const char*>(output.data()), output.size())) {
+        std::cerr << "Failed to write '" << argv[2] << "'.\n";
+        return 1;
+    }
+
+    output_file.close();
+
+    opt_program written;
+    t_chunk_pos written_code_start;
+    read_program(output, written, written_code_start);
+
+    std::cout << "Instructions: " << instruction_count << " -> " << program.code.size()
+        << ", literals: " << literal_count << " -> " << written.literal_list.size()
+        << ", bytes: " << input.size() << " -> " << output.size() << '\n';
+
+    if (is_verifying && !verify(input, output))
+        return 2;
+
+    return 0;
+}
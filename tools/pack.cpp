@@ -0,0 +1,65 @@
+#include <fstream>
+#include <iostream>
+#include <string>
+
+#include "compress.hpp"
+
+// livm-pack <input chunk> <output chunk> [--unpack]
+// Compresses a plain chunk into the container described in compress.hpp, or with --unpack turns one back into a plain chunk.
+// livm loads either form.
+
+static bool read_file(const std::string& path, t_chunk& data) {
+    std::ifstream file(path, std::ios::binary | std::ios::ate);
+
+    if (!file.is_open()) {
+        std::cerr << "Failed to open '" << path << "'.\n";
+        return false;
+    }
+
+    data.resize(file.tellg());
+    file.seekg(0, std::ios::beg);
+
+    if (!file.read(reinterpret_cast<char*>(data.data()), data.size())) {
+        std::cerr << "Failed to read '" << path << "'.\n";
+        return false;
+    }
+
+    return true;
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 3 || argc > 4 || (argc == 4 && std::string(argv[3]) != "--unpack")) {
+        std::cout << "Usage: livm-pack <input chunk> <output chunk> [--unpack]\n";
+        return 1;
+    }
+
+    const bool is_unpack = argc == 4;
+    t_chunk input;
+
+    if (!read_file(argv[1], input))
+        return 1;
+
+    t_chunk output;
+
+    try {
+        output = is_unpack ? decompress_chunk(input) : compress_chunk(input);
+
+        // Catches codec bugs before a broken chunk gets shipped.
+        if (!is_unpack && decompress_chunk(output) != input)
+            throw vm_trap("Compressed chunk does not decode back to the input.");
+    }
+    catch (const vm_trap& error) {
+        std::cerr << error.what() << '\n';
+        return 1;
+    }
+
+    std::ofstream file(argv[2], std::ios::binary);
+
+    if (!file.write(reinterpret_cast<const char*>(output.data()), output.size())) {
+        std::cerr << "Failed to write '" << argv[2] << "'.\n";
+        return 1;
+    }
+
+    std::cout << argv[1] << ": " << input.size() << " -> " << output.size() << " bytes\n";
+    return 0;
+}
@@ -0,0 +1,165 @@
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <string>
+#include <cstring>
+
+#include "trace.hpp"
+#include "util.hpp"
+
+// livm-trace <trace file> [--chrome]
+// Prints a trace written by run_state::dump_trace, either as text or as Chrome trace event JSON (chrome://tracing, Perfetto).
+// Timestamps are only as fine as TRACE_CLOCK_INTERVAL events.
+
+struct trace_thread {
+    uint8_t id;
+    std::vector<trace_record> records;
+};
+
+static bool read_trace(const std::string& path, double& ticks_per_second, std::vector<trace_thread>& threads) {
+    std::ifstream file(path, std::ios::binary);
+
+    if (!file.is_open()) {
+        std::cerr << "Failed to open '" << path << "'.\n";
+        return false;
+    }
+
+    char magic[4];
+    uint32_t version;
+    uint64_t ticks_bits;
+    uint8_t thread_count;
+
+    file.read(magic, 4);
+    file.read(reinterpret_cast<char*>(&version), sizeof(version));
+    file.read(reinterpret_cast<char*>(&ticks_bits), sizeof(ticks_bits));
+    file.read(reinterpret_cast<char*>(&thread_count), sizeof(thread_count));
+
+    if (!file || memcmp(magic, "LVTR", 4) != 0 || version != TRACE_VERSION) {
+        std::cerr << "'" << path << "' is not a version " << TRACE_VERSION << " trace.\n";
+        return false;
+    }
+
+    ticks_per_second = bit_util::bit_cast<uint64_t, double>(ticks_bits);
+
+    // Record counts are checked against what is left of the file, so a corrupt count can't ask for a huge buffer.
+    const std::streampos records_start = file.tellg();
+    file.seekg(0, std::ios::end);
+    const std::streampos file_end = file.tellg();
+    file.seekg(records_start);
+
+    for (uint8_t i = 0; i < thread_count; i++) {
+        trace_thread& thread = threads.emplace_back();
+        uint32_t record_count;
+
+        file.read(reinterpret_cast<char*>(&thread.id), sizeof(thread.id));
+        file.read(reinterpret_cast<char*>(&record_count), sizeof(record_count));
+
+        if (!file || record_count > static_cast<uint64_t>(file_end - file.tellg()) / sizeof(trace_record)) {
+            std::cerr << "Trace is truncated.\n";
+            return false;
+        }
+
+        thread.records.resize(record_count);
+        file.read(reinterpret_cast<char*>(thread.records.data()), record_count * sizeof(trace_record));
+
+        if (!file) {
+            std::cerr << "Trace is truncated.\n";
+            return false;
+        }
+    }
+
+    return true;
+}
+
+static std::string describe(const trace_record& record) {
+    switch (record.kind) {
+        case TRACE_JUMP:   return "jump -> " + std::to_string(record.operand0);
+        case TRACE_CALL:   return "call -> " + std::to_string(record.operand0) + " (return reg " + std::to_string(record.operand1) + ")";
+        case TRACE_TAIL_CALL: return "tail call -> " + std::to_string(record.operand0);
+        case TRACE_DESYNC: return "desync -> " + std::to_string(record.operand0) + " (" + std::to_string(record.operand1) + " args)";
+        case TRACE_MALLOC: return "malloc " + std::to_string(record.operand1) + " bytes at " + std::to_string(record.operand0);
+        case TRACE_MFREE:  return "mfree " + std::to_string(record.operand1) + " bytes at " + std::to_string(record.operand0);
+        case TRACE_RETURN: return "return -> " + std::to_string(record.operand0);
+        case TRACE_TRAP:   return "TRAP";
+        default:           return "";
+    }
+}
+
+static void print_text(const double ticks_per_us, const uint64_t origin, const std::vector<trace_thread>& threads) {
+    for (const trace_thread& thread : threads) {
+        std::cout << "Thread " << static_cast<int>(thread.id) << " (" << thread.records.size() << " records)\n";
+
+        for (const trace_record& record : thread.records) {
+            const double us = (record.timestamp - origin) / ticks_per_us;
+
+            std::cout << "  " << std::to_string(us) << " us  ip " << record.ip << "  op " << static_cast<int>(record.opcode) << "  " << describe(record) << '\n';
+        }
+    }
+}
+
+static void print_chrome(const double ticks_per_us, const uint64_t origin, const std::vector<trace_thread>& threads) {
+    std::cout << "{\"traceEvents\":[\n";
+    bool first = true;
+
+    auto event = [&](const trace_thread& thread, const trace_record& record, const std::string& body) {
+        if (!first)
+            std::cout << ",\n";
+
+        first = false;
+        std::cout << "{\"pid\":0,\"tid\":" << static_cast<int>(thread.id) << ",\"ts\":" << std::to_string((record.timestamp - origin) / ticks_per_us) << ',' << body << '}';
+    };
+
+    // Jumps are left out, loops would drown the timeline.
+    for (const trace_thread& thread : threads) {
+        for (const trace_record& record : thread.records) {
+            const std::string args = "\"args\":{\"ip\":" + std::to_string(record.ip) + ",\"operand0\":" + std::to_string(record.operand0) + ",\"operand1\":" + std::to_string(record.operand1) + '}';
+
+            switch (record.kind) {
+                case TRACE_CALL:   event(thread, record, "\"ph\":\"B\",\"name\":\"fn@" + std::to_string(record.operand0) + "\"," + args); break;
+                case TRACE_RETURN: event(thread, record, "\"ph\":\"E\""); break;
+                case TRACE_TAIL_CALL:
+                    // The reused frame ends where the new one begins.
+                    event(thread, record, "\"ph\":\"E\"");
+                    event(thread, record, "\"ph\":\"B\",\"name\":\"fn@" + std::to_string(record.operand0) + "\"," + args);
+                    break;
+                case TRACE_DESYNC: event(thread, record, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"desync\"," + args); break;
+                case TRACE_MALLOC: event(thread, record, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"malloc\"," + args); break;
+                case TRACE_MFREE:  event(thread, record, "\"ph\":\"i\",\"s\":\"t\",\"name\":\"mfree\"," + args); break;
+                case TRACE_TRAP:   event(thread, record, "\"ph\":\"i\",\"s\":\"g\",\"name\":\"trap\"," + args); break;
+                default: break;
+            }
+        }
+    }
+
+    std::cout << "\n]}\n";
+}
+
+int main(int argc, char* argv[]) {
+    if (argc < 2 || argc > 3 || (argc == 3 && std::string(argv[2]) != "--chrome")) {
+        std::cout << "Usage: livm-trace <trace file> [--chrome]\n";
+        return 1;
+    }
+
+    double ticks_per_second;
+    std::vector<trace_thread> threads;
+
+    if (!read_trace(argv[1], ticks_per_second, threads))
+        return 1;
+
+    // Time is shown relative to the oldest record still in any ring.
+    uint64_t origin = UINT64_MAX;
+
+    for (const trace_thread& thread : threads) {
+        if (!thread.records.empty())
+            origin = std::min(origin, thread.records.front().timestamp);
+    }
+
+    const double ticks_per_us = ticks_per_second / 1e6;
+
+    if (argc == 3)
+        print_chrome(ticks_per_us, origin, threads);
+    else
+        print_text(ticks_per_us, origin, threads);
+
+    return 0;
+}